@@ -1,19 +1,90 @@
 #include <errno.h>
 #include <fcntl.h>
-#include <inttypes.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define MEM32(mem, addr) (*(int32_t *)((char *)(mem) + (addr) - 256))
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* guest memory outside the loaded image is made of these */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+/* each page table covers this much of the address space */
+#define TABLE_SHIFT 22
+#define TABLE_PAGES (1 << (TABLE_SHIFT - PAGE_SHIFT))
+/* guest addresses run from 256 up to here; anything else is out of range */
+#define MEM_LIMIT 0x80000000u
+/* the page and alignment bits of an address; no masked address is PAGE_NONE */
+#define PAGE_MASK (~(uint32_t)(PAGE_SIZE - 1) | 3)
+#define PAGE_NONE 4
 
 static const char *const disassembly_filename = "disassembly.txt";
 static const char *const simulation_filename = "simulation.txt";
+static const char *const delta_filename = "simulation.delta";
+
+enum
+{
+  OP_INVALID,
+  OP_NOP,
+  OP_BEQ,
+  OP_BNE,
+  OP_BLT,
+  OP_SW,
+  OP_ADD,
+  OP_SUB,
+  OP_AND,
+  OP_OR,
+  OP_ADDI,
+  OP_ANDI,
+  OP_ORI,
+  OP_SLL,
+  OP_SRA,
+  OP_LW,
+  OP_JAL,
+  OP_BREAK,
+};
+
+/* predecoded instruction; imm holds the absolute target for beq/bne/blt/jal */
+struct op
+{
+  uint8_t kind;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  int32_t imm;
+};
+
+/*
+ * Guest memory. The loaded image is one flat block; everything past it lives
+ * in 4 KiB pages that are allocated on the first store to them and found
+ * through a two-level table, with the last page used cached in front of it.
+ * Loads from pages that were never stored to read zero.
+ */
+struct memory
+{
+  /*
+   * guest bytes [256, 256 + 4 * flat_words); not a uint32_t so that stores
+   * to guest memory cannot alias it
+   */
+  char *flat;
+  size_t flat_words;
+  /* the cached page: its guest address and its host address minus that */
+  uint32_t page;
+  uintptr_t host;
+  char **tables[MEM_LIMIT >> TABLE_SHIFT];
+};
 
 struct program
 {
@@ -23,18 +94,13 @@ struct program
   uint32_t mem_lower;
   uint32_t mem_data;
   uint32_t mem_upper;
-  void *mem;
+  struct memory mem;
+  struct op *ops;
+  /* cached image mapping that holds the flat memory, if any */
+  void *map;
+  size_t map_size;
 };
 
-static void write_bin32(FILE *out, uint32_t word)
-{
-  char bin[32];
-  for (int i = 0; i < 32; i++) {
-    bin[i] = '0' + (word >> (31 - i) & 1);
-  }
-  fwrite(bin, sizeof(bin), 1, out);
-}
-
 static void err(const char *format, ...)
 {
   va_list ap;
@@ -55,332 +121,2857 @@ static void err_sys(const char *format, ...)
   fprintf(stderr, ": %s\n", strerror(errno));
 }
 
-static int init_program_from_fd(struct program *program, int fd)
+struct writer;
+struct jit;
+
+/*
+ * A simulation run as one input of a batch, which an error ends without
+ * ending the batch. fail() releases what the run holds, as the frames
+ * holding it are about to go, and resumes at env.
+ */
+struct job
 {
+  jmp_buf env;
+  /* the trace being written */
+  struct writer *out;
+  /* the threaded engine's code, superblock, entries and hits */
+  void *threaded[4];
+  /* the JIT engine's state */
+  struct jit *jit;
+};
 
-  struct stat st;
-  if (fstat(fd, &st)) {
-    err_sys("fstat");
-    return -1;
+/* the job this thread is running, if any */
+static _Thread_local struct job *job;
+
+/* exit with status, or within a job, give up only the job */
+static void __attribute__((noreturn)) fail(int status);
+
+static void memory_init(struct memory *mem, char *flat, uint32_t flat_size)
+{
+  memset(mem, 0, sizeof(*mem));
+  mem->flat = flat;
+  mem->flat_words = flat_size / 4;
+  mem->page = PAGE_NONE;
+}
+
+/* Free the pages; the flat block belongs to the caller. */
+static void memory_free(struct memory *mem)
+{
+  for (uint32_t t = 0; t < MEM_LIMIT >> TABLE_SHIFT; t++) {
+    if (mem->tables[t]) {
+      for (uint32_t p = 0; p < TABLE_PAGES; p++) {
+        free(mem->tables[t][p]);
+      }
+      free(mem->tables[t]);
+    }
   }
+}
 
-  uint32_t max_mem_size = st.st_size / 8;
-  void *mem = calloc(1, max_mem_size);
-  if (!mem) {
-    err("failed to allocate program memory");
-    return -1;
+static void __attribute__((noreturn)) memory_fault(uint32_t addr)
+{
+  err("%s memory access at address %d",
+      addr & 3 ? "misaligned" : "out-of-range", (int32_t)addr);
+  fail(1);
+}
+
+/* Return the page holding addr, or NULL if it was never stored to. */
+static inline char *memory_find(const struct memory *mem, uint32_t addr)
+{
+  if (addr < 256 || addr >= MEM_LIMIT || (addr & 3)) {
+    memory_fault(addr);
   }
+  char **table = mem->tables[addr >> TABLE_SHIFT];
+  return table ? table[addr >> PAGE_SHIFT & (TABLE_PAGES - 1)] : NULL;
+}
 
-  char buffer[1024];
-  int bitcount = 0;
-  uint32_t word = 0;
-  uint32_t mem_size = 0;
-  uint32_t mem_data = 0;
+/* Page 0 also holds the out-of-range addresses below 256, so it is never cached. */
+static inline char *memory_cache(struct memory *mem, uint32_t addr, char *page)
+{
+  if (addr >= PAGE_SIZE) {
+    mem->page = addr & ~(uint32_t)(PAGE_SIZE - 1);
+    mem->host = (uintptr_t)page - mem->page;
+  }
+  return page + (addr & (PAGE_SIZE - 1));
+}
 
-  while (1) {
-    char *cur, *end;
-    ssize_t len = read(fd, buffer, sizeof(buffer));
-    if (len < 0) {
-      err_sys("read");
-      free(mem);
-      return -1;
-    }
-    if (len == 0) {
-      break;
+static void __attribute__((noinline)) memory_store(struct memory *mem,
+    uint32_t addr, int32_t value)
+{
+  char *page = memory_find(mem, addr);
+  if (!page) {
+    char ***table = &mem->tables[addr >> TABLE_SHIFT];
+    if (!*table && !(*table = calloc(TABLE_PAGES, sizeof(**table)))) {
+      err("failed to allocate guest memory");
+      fail(1);
     }
-    end = buffer + len;
-    for (cur = buffer; cur < end; cur++) {
-      if (*cur == '0') {
-        word = word << 1;
-      } else if (*cur == '1') {
-        word = word << 1 | 1;
-      } else {
-        continue;
-      }
-      if (++bitcount < 32) {
-        continue;
-      }
-      uint32_t addr = mem_size + 256;
-      MEM32(mem, addr) = word;
-      /* detect break */
-      if (!mem_data && word == 127) {
-        mem_data = addr + 4;
-      }
-      bitcount = 0;
-      word = 0;
-      mem_size += 4;
+    page = (*table)[addr >> PAGE_SHIFT & (TABLE_PAGES - 1)] = calloc(1, PAGE_SIZE);
+    if (!page) {
+      err("failed to allocate guest memory");
+      fail(1);
     }
   }
+  *(int32_t *)memory_cache(mem, addr, page) = value;
+}
 
-  if (!mem_data) {
-    err("no break instruction found");
-    free(mem);
-    return -1;
+/* Word index of addr in the flat block; misaligned addresses rotate out of range. */
+static inline uint32_t flat_index(uint32_t addr)
+{
+  uint32_t offset = addr - 256;
+  return offset >> 2 | offset << 30;
+}
+
+static inline int32_t mem_load(struct memory *mem, uint32_t addr)
+{
+  if (flat_index(addr) < mem->flat_words) {
+    return *(int32_t *)(mem->flat + addr - 256);
+  }
+  if ((addr & PAGE_MASK) == mem->page) {
+    return *(int32_t *)(mem->host + addr);
   }
+  char *page = memory_find(mem, addr);
+  return page ? *(int32_t *)memory_cache(mem, addr, page) : 0;
+}
 
-  memset(program, 0, sizeof(*program));
-  program->pc = 256;
-  program->mem_size = mem_size;
-  program->mem_lower = 256;
-  program->mem_data = mem_data;
-  program->mem_upper = mem_size + 256;
-  program->mem = mem;
-  return 0;
+/* Load without touching the cached page. */
+static inline int32_t mem_peek(const struct memory *mem, uint32_t addr)
+{
+  if (flat_index(addr) < mem->flat_words) {
+    return *(int32_t *)(mem->flat + addr - 256);
+  }
+  char *page = memory_find(mem, addr);
+  return page ? *(int32_t *)(page + (addr & (PAGE_SIZE - 1))) : 0;
 }
 
-static int init_program(struct program *program, const char *filename)
+static inline void mem_store(struct memory *mem, uint32_t addr, int32_t value)
 {
-  int fd = open(filename, O_RDONLY);
-  if (fd < 0) {
-    err_sys("failed to open '%s'", filename);
-    return -1;
+  if (flat_index(addr) < mem->flat_words) {
+    *(int32_t *)(mem->flat + addr - 256) = value;
+  } else if ((addr & PAGE_MASK) == mem->page) {
+    *(int32_t *)(mem->host + addr) = value;
+  } else {
+    memory_store(mem, addr, value);
   }
-  int ret = init_program_from_fd(program, fd);
-  close(fd);
-  return ret;
 }
 
-static void process_instruction(FILE *out, struct program *program,
-    uint32_t ins, uint32_t addr)
+#define SEPARATOR "--------------------"
+#define SEPARATOR_LEN (sizeof(SEPARATOR) - 1)
+
+/*
+ * Verify mode: instead of writing its output, a writer compares it with an
+ * expected trace as it is produced. At the first difference it keeps
+ * collecting output until the cycle block holding it is complete, then
+ * reports the expected and actual versions of that block.
+ */
+struct verifier
 {
-  unsigned int rs1, rs2, rd;
-  int imm;
-  switch (ins & 3) {
-    /* Category-1 */
-    case 0:
-      rs1 = ins >> 15 & 31;
-      rs2 = ins >> 20 & 31;
-      imm = (ins >> 7 & 31) | ((int32_t)ins >> 20 & ~31);
-      switch (ins >> 2 & 31) {
-        /* beq rs1, rs2, #imm */
-        case 0:
-          fprintf(out, "beq x%u, x%u, #%d", rs1, rs2, imm);
-          if (program && program->regs[rs1] == program->regs[rs2]) {
-            program->pc = addr + (imm << 1);
-          }
-          return;
-        /* bne rs1, rs2, #imm */
-        case 1:
-          fprintf(out, "bne x%u, x%u, #%d", rs1, rs2, imm);
-          if (program && program->regs[rs1] != program->regs[rs2]) {
-            program->pc = addr + (imm << 1);
-          }
-          return;
-        /* blt rs1, rs2, #imm */
-        case 2:
-          fprintf(out, "blt x%u, x%u, #%d", rs1, rs2, imm);
-          if (program && (int32_t)program->regs[rs1] < (int32_t)program->regs[rs2]) {
-            program->pc = addr + (imm << 1);
-          }
-          return;
-        /* sw rs1, imm(rs2) */
-        case 3:
-          fprintf(out, "sw x%u, %d(x%u)", rs1, imm, rs2);
-          if (program) {
-            MEM32(program->mem, program->regs[rs2] + imm) = program->regs[rs1];
-          }
-          return;
-      }
-      break;
-    /* Category-2 */
-    case 1:
-      rd = ins >> 7 & 31;
-      rs1 = ins >> 15 & 31;
-      rs2 = ins >> 20 & 31;
-      switch (ins >> 2 & 31) {
-        /* add rd, rs1, rs2 */
-        case 0:
-          fprintf(out, "add x%u, x%u, x%u", rd, rs1, rs2);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] + program->regs[rs2];
-          }
-          return;
-        /* sub rd, rs1, rs2 */
-        case 1:
-          fprintf(out, "sub x%u, x%u, x%u", rd, rs1, rs2);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] - program->regs[rs2];
-          }
-          return;
-        /* and rd, rs1, rs2 */
-        case 2:
-          fprintf(out, "and x%u, x%u, x%u", rd, rs1, rs2);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] & program->regs[rs2];
-          }
-          return;
-        /* or rd, rs1, rs2 */
-        case 3:
-          fprintf(out, "or x%u, x%u, x%u", rd, rs1, rs2);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] | program->regs[rs2];
-          }
-          return;
-      }
-      break;
-    /* Category-3 */
-    case 2:
-      rd = ins >> 7 & 31;
-      rs1 = ins >> 15 & 31;
-      imm = (int32_t)ins >> 20;
-      switch (ins >> 2 & 31) {
-        /* addi rd, rs1, #imm */
-        case 0:
-          fprintf(out, "addi x%u, x%u, #%d", rd, rs1, imm);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] + imm;
-          }
-          return;
-        /* andi rd, rs1, #imm */
-        case 1:
-          fprintf(out, "andi x%u, x%u, #%d", rd, rs1, imm);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] & imm;
-          }
-          return;
-        /* ori rd, rs1, #imm */
-        case 2:
-          fprintf(out, "ori x%u, x%u, #%d", rd, rs1, imm);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] | imm;
-          }
-          return;
-        /* sll rd, rs1, #imm */
-        case 3:
-          fprintf(out, "sll x%u, x%u, #%d", rd, rs1, imm);
-          if (program && rd) {
-            program->regs[rd] = program->regs[rs1] << imm;
-          }
-          return;
-        /* sra rd, rs1, #imm */
-        case 4:
-          fprintf(out, "sra x%u, x%u, #%d", rd, rs1, imm);
-          if (program && rd) {
-            program->regs[rd] = (int32_t)program->regs[rs1] >> imm;
-          }
-          return;
-        /* lw rd, imm(rs1) */
-        case 5:
-          fprintf(out, "lw x%u, %d(x%u)", rd, imm, rs1);
-          if (program && rd) {
-            program->regs[rd] = MEM32(program->mem, program->regs[rs1] + imm);
-          }
-          return;
-      }
-      break;
-    /* Category-4 */
-    case 3:
-      rd = ins >> 7 & 31;
-      imm = (int32_t)ins >> 12;
-      switch (ins >> 2 & 31) {
-        /* jal rd, #imm */
-        case 0:
-          fprintf(out, "jal x%u, #%d", rd, imm);
-          if (program) {
-            if (rd) {
-              program->regs[rd] = program->pc;
-            }
-            program->pc = addr + (imm << 1);
-          }
-          return;
-        /* break */
-        case 31:
-          fprintf(out, "break");
-          if (program) {
-            program->pc = 0;
-          }
-          return;
-      }
-      break;
+  const char *name;
+  const char *expect;
+  size_t size;
+  /* length of the output that matched so far */
+  size_t matched;
+  int diverged;
+  /* the file has no separator before the difference; report one line */
+  int lines;
+  /* once diverged: the output from offset block of the expected file on */
+  size_t block;
+  char *actual;
+  size_t actual_len;
+  size_t actual_cap;
+};
+
+static int is_separator(const char *data, size_t size, size_t line)
+{
+  return size - line >= SEPARATOR_LEN
+    && !memcmp(data + line, SEPARATOR, SEPARATOR_LEN);
+}
+
+/* Start of the block holding pos: the last separator line at or before it. */
+static size_t block_start(const char *data, size_t size, size_t pos)
+{
+  size_t line = pos;
+  while (line && data[line - 1] != '\n') {
+    line--;
+  }
+  size_t start = line;
+  for (;;) {
+    if (is_separator(data, size, line)) {
+      return line;
+    }
+    if (!line) {
+      return start;
+    }
+    do {
+      line--;
+    } while (line && data[line - 1] != '\n');
   }
-  fprintf(out, "invalid");
 }
 
-static void disassemble_to(FILE *out, struct program *program)
+/*
+ * End of the block that starts at block and holds pos: the next separator
+ * line, or the end of pos's line if lines is set. Returns -1 if data ends
+ * first.
+ */
+static size_t block_end(const char *data, size_t size, size_t block,
+    size_t pos, int lines)
 {
-  for (uint32_t addr = program->mem_lower; addr < program->mem_upper; addr += 4) {
-    uint32_t word = MEM32(program->mem, addr);
-    write_bin32(out, word);
-    fprintf(out, "\t%" PRIu32 "\t", addr);
-    if (addr < program->mem_data) {
-      process_instruction(out, NULL, word, addr);
-    } else {
-      fprintf(out, "%" PRId32, (int32_t)word);
+  if (lines) {
+    const char *end = memchr(data + pos, '\n', size - pos);
+    return end ? (size_t)(end - data) + 1 : (size_t)-1;
+  }
+  size_t line = pos;
+  while (line > block && data[line - 1] != '\n') {
+    line--;
+  }
+  for (;;) {
+    if (line > block && is_separator(data, size, line)) {
+      return line;
+    }
+    if (size - line < SEPARATOR_LEN) {
+      return -1;
+    }
+    const char *end = memchr(data + line, '\n', size - line);
+    if (!end) {
+      return -1;
     }
-    fputc('\n', out);
+    line = end - data + 1;
   }
 }
 
-static int disassemble(const char *filename, struct program *program)
+/* Cycle number of a block that opens with a separator, or 0. */
+static unsigned long block_cycle(const char *data, size_t len)
 {
-  FILE *file = fopen(filename, "w");
-  if (!file) {
+  static const char cycle[] = SEPARATOR "\nCycle ";
+  unsigned long value = 0;
+  if (len < sizeof(cycle) - 1 || memcmp(data, cycle, sizeof(cycle) - 1)) {
+    return 0;
+  }
+  for (size_t i = sizeof(cycle) - 1; i < len && data[i] >= '0'
+      && data[i] <= '9'; i++) {
+    value = value * 10 + (data[i] - '0');
+  }
+  return value;
+}
+
+static int verify_open(struct verifier *v, const char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     err_sys("failed to open '%s'", filename);
-    return 1;
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    err_sys("fstat");
+    close(fd);
+    return -1;
+  }
+  memset(v, 0, sizeof(*v));
+  v->name = filename;
+  v->expect = "";
+  v->size = st.st_size;
+  if (v->size) {
+    v->expect = mmap(NULL, v->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (v->expect == MAP_FAILED) {
+      err_sys("mmap");
+      close(fd);
+      return -1;
+    }
   }
-  disassemble_to(file, program);
-  fclose(file);
+  close(fd);
   return 0;
 }
 
-static void simulate_to(FILE *out, struct program *program)
+static void verify_append(struct verifier *v, const char *data, size_t n)
 {
-  unsigned int counter = 0;
-  uint32_t data_size = program->mem_upper - program->mem_data;
-  while (program->pc) {
-    uint32_t addr = program->pc;
-    uint32_t ins = MEM32(program->mem, addr);
-    ++counter;
-    fprintf(out,
-        "--------------------\n"
-        "Cycle %u:\t%"PRIu32"\t"
-        , counter, addr);
-    program->pc += 4;
-    process_instruction(out, program, ins, addr);
-    fprintf(out, "\nRegisters");
-    for (unsigned int r = 0; r < 32; r++) {
-      if ((r & 7) == 0) {
-        fprintf(out, "\nx%02u:", r);
-      }
-      fprintf(out, "\t%"PRId32, (int32_t)program->regs[r]);
+  if (v->actual_len + n > v->actual_cap) {
+    size_t cap = v->actual_cap ? v->actual_cap : 4096;
+    while (cap < v->actual_len + n) {
+      cap *= 2;
     }
-    fprintf(out, "\nData");
-    for (uint32_t offset = 0; offset < data_size; offset += 4) {
-      uint32_t mem_addr = program->mem_data + offset;
-      if ((offset & 31) == 0) {
-        fprintf(out, "\n%"PRIu32":", mem_addr);
-      }
-      fprintf(out, "\t%"PRId32, MEM32(program->mem, mem_addr));
+    char *actual = realloc(v->actual, cap);
+    if (!actual) {
+      err("failed to allocate verify buffer");
+      fail(1);
     }
-    fputc('\n', out);
+    v->actual = actual;
+    v->actual_cap = cap;
   }
+  memcpy(v->actual + v->actual_len, data, n);
+  v->actual_len += n;
 }
 
-static int simulate(const char *filename, struct program *program)
+/* Start collecting the block around the first difference at v->matched. */
+static void verify_diverge(struct verifier *v)
 {
-  FILE *file = fopen(filename, "w");
-  if (!file) {
-    err_sys("failed to open '%s'", filename);
-    return 1;
-  }
-  simulate_to(file, program);
-  fclose(file);
-  return 0;
+  v->diverged = 1;
+  v->block = block_start(v->expect, v->size, v->matched);
+  v->lines = !is_separator(v->expect, v->size, v->block);
+  verify_append(v, v->expect + v->block, v->matched - v->block);
 }
 
-int main(int argc, char **argv)
+static void verify_report(struct verifier *v, size_t actual_end)
 {
-  if (argc < 2) {
-    fprintf(stderr, "usage: Vsim <input>\n");
-    return 2;
+  const char *expect = v->expect + v->block;
+  size_t expect_end = block_end(v->expect, v->size, v->block, v->matched,
+      v->lines);
+  if (expect_end == (size_t)-1) {
+    expect_end = v->size;
+  }
+  size_t expect_len = expect_end - v->block;
+  size_t line = 1;
+  for (const char *p = v->expect; (p = memchr(p, '\n',
+      v->expect + v->matched - p)); p++) {
+    line++;
+  }
+  unsigned long cycle = block_cycle(expect, expect_len);
+  if (!cycle) {
+    cycle = block_cycle(v->actual, actual_end);
+  }
+  if (cycle) {
+    err("output differs from '%s' at cycle %lu (line %zu)", v->name, cycle,
+        line);
+  } else {
+    err("output differs from '%s' at line %zu", v->name, line);
+  }
+  fputs("expected:\n", stderr);
+  fwrite(expect, 1, expect_len, stderr);
+  if (!expect_len) {
+    fputs("(end of file)\n", stderr);
+  }
+  fputs("actual:\n", stderr);
+  fwrite(v->actual, 1, actual_end, stderr);
+  if (!actual_end) {
+    fputs("(end of output)\n", stderr);
   }
+}
 
-  struct program program;
-  if (init_program(&program, argv[1])) {
-    return 1;
+static void verify_write(struct verifier *v, const char *data, size_t n)
+{
+  if (!v->diverged) {
+    const char *expect = v->expect + v->matched;
+    size_t len = v->size - v->matched < n ? v->size - v->matched : n;
+    if (len == n && !memcmp(data, expect, n)) {
+      v->matched += n;
+      return;
+    }
+    size_t i = 0;
+    while (i < len && data[i] == expect[i]) {
+      i++;
+    }
+    v->matched += i;
+    verify_diverge(v);
+    data += i;
+    n -= i;
   }
+  verify_append(v, data, n);
+  size_t end = block_end(v->actual, v->actual_len, 0, v->matched - v->block,
+      v->lines);
+  if (end != (size_t)-1) {
+    verify_report(v, end);
+    fail(1);
+  }
+}
 
-  disassemble(disassembly_filename, &program);
-  simulate(simulation_filename, &program);
+/* Finish verifying; output that ends early or late is a difference too. */
+static int verify_close(struct verifier *v)
+{
+  int ret = 0;
+  if (!v->diverged && v->matched < v->size) {
+    verify_diverge(v);
+  }
+  if (v->diverged) {
+    size_t end = block_end(v->actual, v->actual_len, 0,
+        v->matched - v->block, v->lines);
+    verify_report(v, end == (size_t)-1 ? v->actual_len : end);
+    ret = -1;
+  }
+  if (v->size) {
+    munmap((void *)v->expect, v->size);
+  }
+  free(v->actual);
+  return ret;
+}
+
+#define WRITER_SIZE (1 << 20)
+
+/*
+ * Buffered output that formats integers by hand and flushes with large
+ * write() calls. Errors are sticky and reported by writer_close(). With
+ * verify set, output is checked against an expected file instead.
+ */
+struct writer
+{
+  int fd;
+  int error;
+  size_t len;
+  char *buf;
+  struct verifier *verify;
+};
+
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static int writer_open(struct writer *w, const char *filename)
+{
+  w->buf = malloc(WRITER_SIZE);
+  if (!w->buf) {
+    err("failed to allocate output buffer");
+    return -1;
+  }
+  w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (w->fd < 0) {
+    err_sys("failed to open '%s'", filename);
+    free(w->buf);
+    return -1;
+  }
+  w->error = 0;
+  w->len = 0;
+  w->verify = NULL;
+  return 0;
+}
+
+static int writer_open_verify(struct writer *w, const char *expected)
+{
+  w->buf = malloc(WRITER_SIZE);
+  w->verify = malloc(sizeof(*w->verify));
+  if (!w->buf || !w->verify) {
+    err("failed to allocate output buffer");
+    free(w->buf);
+    free(w->verify);
+    return -1;
+  }
+  if (verify_open(w->verify, expected)) {
+    free(w->buf);
+    free(w->verify);
+    return -1;
+  }
+  w->fd = -1;
+  w->error = 0;
+  w->len = 0;
+  return 0;
+}
+
+static void writer_flush(struct writer *w)
+{
+  if (w->verify) {
+    verify_write(w->verify, w->buf, w->len);
+    w->len = 0;
+    return;
+  }
+  char *cur = w->buf;
+  char *end = w->buf + w->len;
+  while (cur < end && !w->error) {
+    ssize_t len = write(w->fd, cur, end - cur);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err_sys("write");
+      w->error = 1;
+      break;
+    }
+    cur += len;
+  }
+  w->len = 0;
+}
+
+static int writer_close(struct writer *w)
+{
+  writer_flush(w);
+  if (w->verify) {
+    w->error = verify_close(w->verify) ? 1 : 0;
+    free(w->verify);
+  } else if (close(w->fd) && !w->error) {
+    err_sys("close");
+    w->error = 1;
+  }
+  free(w->buf);
+  return w->error ? -1 : 0;
+}
+
+/* Make room for n bytes (n <= WRITER_SIZE) and return where they go. */
+static inline char *writer_reserve(struct writer *w, size_t n)
+{
+  if (w->len + n > WRITER_SIZE) {
+    writer_flush(w);
+  }
+  return w->buf + w->len;
+}
+
+static void writer_write_slow(struct writer *w, const char *data, size_t n)
+{
+  while (n) {
+    if (w->len == WRITER_SIZE) {
+      writer_flush(w);
+    }
+    size_t len = WRITER_SIZE - w->len < n ? WRITER_SIZE - w->len : n;
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    data += len;
+    n -= len;
+  }
+}
+
+static inline void writer_write(struct writer *w, const void *data, size_t n)
+{
+  if (n > WRITER_SIZE - w->len) {
+    writer_write_slow(w, data, n);
+    return;
+  }
+  memcpy(w->buf + w->len, data, n);
+  w->len += n;
+}
+
+/* s must be a string literal */
+#define writer_puts(w, s) writer_write(w, s, sizeof(s) - 1)
+
+static inline void writer_putc(struct writer *w, char c)
+{
+  *writer_reserve(w, 1) = c;
+  w->len++;
+}
+
+static inline void writer_uint(struct writer *w, uint32_t value)
+{
+  char tmp[10];
+  char *p = tmp + sizeof(tmp);
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, digit_pairs + value % 100 * 2, 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, digit_pairs + value * 2, 2);
+  } else {
+    *--p = '0' + value;
+  }
+  writer_write(w, p, tmp + sizeof(tmp) - p);
+}
+
+static inline void writer_int(struct writer *w, int32_t value)
+{
+  if (value < 0) {
+    writer_putc(w, '-');
+    writer_uint(w, -(uint32_t)value);
+  } else {
+    writer_uint(w, value);
+  }
+}
+
+static void write_bin32(struct writer *out, uint32_t word)
+{
+  char *bin = writer_reserve(out, 32);
+  for (int i = 0; i < 32; i++) {
+    bin[i] = '0' + (word >> (31 - i) & 1);
+  }
+  out->len += 32;
+}
+
+/* Reverse the bit order of x. */
+static inline uint32_t reverse32(uint32_t x)
+{
+  x = (x >> 1 & 0x55555555) | (x & 0x55555555) << 1;
+  x = (x >> 2 & 0x33333333) | (x & 0x33333333) << 2;
+  x = (x >> 4 & 0x0f0f0f0f) | (x & 0x0f0f0f0f) << 4;
+  return __builtin_bswap32(x);
+}
+
+/*
+ * Pack the 32 characters at s into a word, first character in the most
+ * significant bit. Returns 0 if any of them is not '0' or '1'.
+ */
+static inline int pack_bits32(const char *s, uint32_t *word)
+{
+#if defined(__AVX2__)
+  const __m256i one = _mm256_set1_epi8('1');
+  __m256i v = _mm256_loadu_si256((const __m256i *)s);
+  /* '0' and '1' differ only in the low bit */
+  if ((uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(1)), one)) != 0xffffffff) {
+    return 0;
+  }
+  /* reverse the bytes so that movemask yields the first character in bit 31 */
+  v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+  v = _mm256_permute4x64_epi64(v, 0x4e);
+  *word = _mm256_movemask_epi8(_mm256_slli_epi16(v, 7));
+  return 1;
+#elif defined(__SSE2__)
+  const __m128i one = _mm_set1_epi8('1');
+  const __m128i low = _mm_set1_epi8(1);
+  __m128i lo = _mm_loadu_si128((const __m128i *)s);
+  __m128i hi = _mm_loadu_si128((const __m128i *)(s + 16));
+  /* '0' and '1' differ only in the low bit */
+  __m128i ok = _mm_and_si128(
+      _mm_cmpeq_epi8(_mm_or_si128(lo, low), one),
+      _mm_cmpeq_epi8(_mm_or_si128(hi, low), one));
+  if (_mm_movemask_epi8(ok) != 0xffff) {
+    return 0;
+  }
+  uint32_t mask = _mm_movemask_epi8(_mm_slli_epi16(lo, 7))
+    | (uint32_t)_mm_movemask_epi8(_mm_slli_epi16(hi, 7)) << 16;
+  *word = reverse32(mask);
+  return 1;
+#else
+  uint32_t w = 0;
+  for (int i = 0; i < 32; i++) {
+    if ((s[i] & ~1) != '0') {
+      return 0;
+    }
+    w = w << 1 | (s[i] & 1);
+  }
+  *word = w;
+  return 1;
+#endif
+}
+
+/*
+ * Parse the program text into mem. Every '0' or '1' is one bit and anything
+ * else is ignored, so words may span lines. Runs of 32 bits in a row (the
+ * usual one-word-per-line layout) are packed a whole word at a time.
+ */
+static uint32_t parse_program(const char *cur, const char *end, void *mem,
+    uint32_t *mem_data)
+{
+  int bitcount = 0;
+  uint32_t word = 0;
+  uint32_t mem_size = 0;
+
+  *mem_data = 0;
+  while (cur < end) {
+    if (bitcount == 0 && (*cur & ~1) == '0' && end - cur >= 32
+        && pack_bits32(cur, &word)) {
+      cur += 32;
+    } else {
+      char c = *cur++;
+      if (c == '0') {
+        word = word << 1;
+      } else if (c == '1') {
+        word = word << 1 | 1;
+      } else {
+        continue;
+      }
+      if (++bitcount < 32) {
+        continue;
+      }
+      bitcount = 0;
+    }
+    uint32_t addr = mem_size + 256;
+    ((uint32_t *)mem)[mem_size / 4] = word;
+    /* detect break */
+    if (!*mem_data && word == 127) {
+      *mem_data = addr + 4;
+    }
+    word = 0;
+    mem_size += 4;
+  }
+  return mem_size;
+}
+
+static int init_program_from_fd(struct program *program, int fd)
+{
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    err_sys("fstat");
+    return -1;
+  }
+
+  if (st.st_size / 8 > MEM_LIMIT - 256) {
+    err("program too large");
+    return -1;
+  }
+  uint32_t max_mem_size = st.st_size / 8;
+  void *mem = calloc(1, max_mem_size);
+  if (!mem) {
+    err("failed to allocate program memory");
+    return -1;
+  }
+
+  const char *text = "";
+  if (st.st_size) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+      err_sys("mmap");
+      free(mem);
+      return -1;
+    }
+    madvise((void *)text, st.st_size, MADV_SEQUENTIAL);
+  }
+
+  uint32_t mem_data;
+  uint32_t mem_size = parse_program(text, text + st.st_size, mem, &mem_data);
+  if (st.st_size) {
+    munmap((void *)text, st.st_size);
+  }
+
+  if (!mem_data) {
+    err("no break instruction found");
+    free(mem);
+    return -1;
+  }
+
+  memset(program, 0, sizeof(*program));
+  program->pc = 256;
+  program->mem_size = mem_size;
+  program->mem_lower = 256;
+  program->mem_data = mem_data;
+  program->mem_upper = mem_size + 256;
+  memory_init(&program->mem, mem, max_mem_size);
+  return 0;
+}
+
+#define IMAGE_MAGIC "VSIM1IMG"
+#define IMAGE_BYTE_ORDER 0x01020304
+
+/*
+ * Cached program image: this header followed by the program memory exactly
+ * as the loader leaves it (source_size / 8 bytes), in host byte order. An
+ * image is current if the source size and mtime match; if only the mtime
+ * differs, the source is hashed and compared before giving up on it.
+ */
+struct image_header
+{
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t header_size;
+  uint32_t mem_data;
+  uint32_t mem_upper;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t source_hash;
+  uint64_t reserved;
+};
+
+static uint64_t hash_bytes(const char *data, size_t size)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  uint64_t word;
+  for (; size >= 8; data += 8, size -= 8) {
+    memcpy(&word, data, 8);
+    hash = ((hash << 5 | hash >> 59) ^ word) * 0x100000001b3;
+  }
+  for (; size; data++, size--) {
+    hash = ((hash << 5 | hash >> 59) ^ (unsigned char)*data) * 0x100000001b3;
+  }
+  return hash;
+}
+
+static int hash_file(int fd, size_t size, uint64_t *hash)
+{
+  if (!size) {
+    *hash = hash_bytes(NULL, 0);
+    return 0;
+  }
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    err_sys("mmap");
+    return -1;
+  }
+  *hash = hash_bytes(data, size);
+  munmap(data, size);
+  return 0;
+}
+
+/* Returns 0 if program was loaded from a current image at path. */
+static int load_image(struct program *program, const char *path,
+    int src_fd, const struct stat *src)
+{
+  struct image_header hdr;
+  struct stat st;
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return -1;
+  }
+  uint64_t mem_alloc = src->st_size / 8;
+  if (fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+      || memcmp(hdr.magic, IMAGE_MAGIC, 8)
+      || hdr.byte_order != IMAGE_BYTE_ORDER
+      || hdr.header_size != sizeof(hdr)
+      || hdr.source_size != (uint64_t)src->st_size
+      || (uint64_t)st.st_size != sizeof(hdr) + mem_alloc
+      || hdr.mem_data < 256 || hdr.mem_data > hdr.mem_upper
+      || hdr.mem_upper - 256 > mem_alloc || mem_alloc > MEM_LIMIT - 256) {
+    close(fd);
+    return -1;
+  }
+  if (hdr.source_mtime_sec != src->st_mtim.tv_sec
+      || hdr.source_mtime_nsec != src->st_mtim.tv_nsec) {
+    uint64_t hash;
+    if (hash_file(src_fd, src->st_size, &hash) || hash != hdr.source_hash) {
+      close(fd);
+      return -1;
+    }
+    /* same content, just touched; refresh the timestamp */
+    hdr.source_mtime_sec = src->st_mtim.tv_sec;
+    hdr.source_mtime_nsec = src->st_mtim.tv_nsec;
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      close(fd);
+      return -1;
+    }
+  }
+  char *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return -1;
+  }
+
+  memset(program, 0, sizeof(*program));
+  program->pc = 256;
+  program->mem_size = hdr.mem_upper - 256;
+  program->mem_lower = 256;
+  program->mem_data = hdr.mem_data;
+  program->mem_upper = hdr.mem_upper;
+  memory_init(&program->mem, image + sizeof(hdr), mem_alloc);
+  program->map = image;
+  program->map_size = st.st_size;
+  return 0;
+}
+
+/* Write the freshly loaded program to path. Failure is not fatal. */
+static void save_image(const struct program *program, const char *path,
+    int src_fd, const struct stat *src)
+{
+  struct image_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IMAGE_MAGIC, 8);
+  hdr.byte_order = IMAGE_BYTE_ORDER;
+  hdr.header_size = sizeof(hdr);
+  hdr.mem_data = program->mem_data;
+  hdr.mem_upper = program->mem_upper;
+  hdr.source_size = src->st_size;
+  hdr.source_mtime_sec = src->st_mtim.tv_sec;
+  hdr.source_mtime_nsec = src->st_mtim.tv_nsec;
+  if (hash_file(src_fd, src->st_size, &hdr.source_hash)) {
+    return;
+  }
+
+  /* write to a temporary name so a concurrent run never sees a partial image */
+  size_t len = strlen(path) + 64;
+  char *tmp = malloc(len);
+  if (!tmp) {
+    return;
+  }
+  snprintf(tmp, len, "%s.%ld.%lx.tmp", path, (long)getpid(),
+      (unsigned long)pthread_self());
+  struct writer out;
+  if (writer_open(&out, tmp)) {
+    free(tmp);
+    return;
+  }
+  writer_write(&out, &hdr, sizeof(hdr));
+  writer_write(&out, program->mem.flat, src->st_size / 8);
+  if (writer_close(&out) || rename(tmp, path)) {
+    err_sys("failed to write image '%s'", path);
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+static int init_program(struct program *program, const char *filename,
+    const char *image_path)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    err_sys("failed to open '%s'", filename);
+    return -1;
+  }
+  struct stat st;
+  if (image_path) {
+    if (fstat(fd, &st)) {
+      err_sys("fstat");
+      close(fd);
+      return -1;
+    }
+    if (!load_image(program, image_path, fd, &st)) {
+      close(fd);
+      return 0;
+    }
+  }
+  int ret = init_program_from_fd(program, fd);
+  if (!ret && image_path) {
+    save_image(program, image_path, fd, &st);
+  }
+  close(fd);
+  return ret;
+}
+
+static void free_program(struct program *program)
+{
+  if (program->map) {
+    munmap(program->map, program->map_size);
+  } else {
+    free(program->mem.flat);
+  }
+  memory_free(&program->mem);
+  free(program->ops);
+}
+
+/* xA, xB, #imm */
+static void write_rri(struct writer *out, unsigned int a, unsigned int b, int imm)
+{
+  writer_putc(out, 'x');
+  writer_uint(out, a);
+  writer_puts(out, ", x");
+  writer_uint(out, b);
+  writer_puts(out, ", #");
+  writer_int(out, imm);
+}
+
+/* xA, xB, xC */
+static void write_rrr(struct writer *out, unsigned int a, unsigned int b, unsigned int c)
+{
+  writer_putc(out, 'x');
+  writer_uint(out, a);
+  writer_puts(out, ", x");
+  writer_uint(out, b);
+  writer_puts(out, ", x");
+  writer_uint(out, c);
+}
+
+/* xA, imm(xB) */
+static void write_mem(struct writer *out, unsigned int a, unsigned int b, int imm)
+{
+  writer_putc(out, 'x');
+  writer_uint(out, a);
+  writer_puts(out, ", ");
+  writer_int(out, imm);
+  writer_puts(out, "(x");
+  writer_uint(out, b);
+  writer_putc(out, ')');
+}
+
+/* xA, #imm */
+static void write_ri(struct writer *out, unsigned int a, int imm)
+{
+  writer_putc(out, 'x');
+  writer_uint(out, a);
+  writer_puts(out, ", #");
+  writer_int(out, imm);
+}
+
+static void disassemble_instruction(struct writer *out, uint32_t ins)
+{
+  unsigned int rs1, rs2, rd;
+  int imm;
+  switch (ins & 3) {
+    /* Category-1 */
+    case 0:
+      rs1 = ins >> 15 & 31;
+      rs2 = ins >> 20 & 31;
+      imm = (ins >> 7 & 31) | ((int32_t)ins >> 20 & ~31);
+      switch (ins >> 2 & 31) {
+        /* beq rs1, rs2, #imm */
+        case 0:
+          writer_puts(out, "beq ");
+          write_rri(out, rs1, rs2, imm);
+          return;
+        /* bne rs1, rs2, #imm */
+        case 1:
+          writer_puts(out, "bne ");
+          write_rri(out, rs1, rs2, imm);
+          return;
+        /* blt rs1, rs2, #imm */
+        case 2:
+          writer_puts(out, "blt ");
+          write_rri(out, rs1, rs2, imm);
+          return;
+        /* sw rs1, imm(rs2) */
+        case 3:
+          writer_puts(out, "sw ");
+          write_mem(out, rs1, rs2, imm);
+          return;
+      }
+      break;
+    /* Category-2 */
+    case 1:
+      rd = ins >> 7 & 31;
+      rs1 = ins >> 15 & 31;
+      rs2 = ins >> 20 & 31;
+      switch (ins >> 2 & 31) {
+        /* add rd, rs1, rs2 */
+        case 0:
+          writer_puts(out, "add ");
+          write_rrr(out, rd, rs1, rs2);
+          return;
+        /* sub rd, rs1, rs2 */
+        case 1:
+          writer_puts(out, "sub ");
+          write_rrr(out, rd, rs1, rs2);
+          return;
+        /* and rd, rs1, rs2 */
+        case 2:
+          writer_puts(out, "and ");
+          write_rrr(out, rd, rs1, rs2);
+          return;
+        /* or rd, rs1, rs2 */
+        case 3:
+          writer_puts(out, "or ");
+          write_rrr(out, rd, rs1, rs2);
+          return;
+      }
+      break;
+    /* Category-3 */
+    case 2:
+      rd = ins >> 7 & 31;
+      rs1 = ins >> 15 & 31;
+      imm = (int32_t)ins >> 20;
+      switch (ins >> 2 & 31) {
+        /* addi rd, rs1, #imm */
+        case 0:
+          writer_puts(out, "addi ");
+          write_rri(out, rd, rs1, imm);
+          return;
+        /* andi rd, rs1, #imm */
+        case 1:
+          writer_puts(out, "andi ");
+          write_rri(out, rd, rs1, imm);
+          return;
+        /* ori rd, rs1, #imm */
+        case 2:
+          writer_puts(out, "ori ");
+          write_rri(out, rd, rs1, imm);
+          return;
+        /* sll rd, rs1, #imm */
+        case 3:
+          writer_puts(out, "sll ");
+          write_rri(out, rd, rs1, imm);
+          return;
+        /* sra rd, rs1, #imm */
+        case 4:
+          writer_puts(out, "sra ");
+          write_rri(out, rd, rs1, imm);
+          return;
+        /* lw rd, imm(rs1) */
+        case 5:
+          writer_puts(out, "lw ");
+          write_mem(out, rd, rs1, imm);
+          return;
+      }
+      break;
+    /* Category-4 */
+    case 3:
+      rd = ins >> 7 & 31;
+      imm = (int32_t)ins >> 12;
+      switch (ins >> 2 & 31) {
+        /* jal rd, #imm */
+        case 0:
+          writer_puts(out, "jal ");
+          write_ri(out, rd, imm);
+          return;
+        /* break */
+        case 31:
+          writer_puts(out, "break");
+          return;
+      }
+      break;
+  }
+  writer_puts(out, "invalid");
+}
+
+/*
+ * Decode the instruction word at addr. Branch and jump offsets are resolved
+ * to absolute targets, and writes to x0 become OP_NOP so that the handlers
+ * never need to test rd.
+ */
+static void decode_op(struct op *op, uint32_t ins, uint32_t addr)
+{
+  unsigned int kind = OP_INVALID;
+  unsigned int rd = 0, rs1 = 0, rs2 = 0;
+  int32_t imm = 0;
+  switch (ins & 3) {
+    /* Category-1 */
+    case 0:
+      rs1 = ins >> 15 & 31;
+      rs2 = ins >> 20 & 31;
+      imm = (ins >> 7 & 31) | ((int32_t)ins >> 20 & ~31);
+      switch (ins >> 2 & 31) {
+        case 0: kind = OP_BEQ; break;
+        case 1: kind = OP_BNE; break;
+        case 2: kind = OP_BLT; break;
+        case 3: kind = OP_SW; break;
+      }
+      if (kind != OP_SW) {
+        imm = addr + (imm << 1);
+      }
+      break;
+    /* Category-2 */
+    case 1:
+      rd = ins >> 7 & 31;
+      rs1 = ins >> 15 & 31;
+      rs2 = ins >> 20 & 31;
+      switch (ins >> 2 & 31) {
+        case 0: kind = OP_ADD; break;
+        case 1: kind = OP_SUB; break;
+        case 2: kind = OP_AND; break;
+        case 3: kind = OP_OR; break;
+      }
+      if (kind != OP_INVALID && !rd) {
+        kind = OP_NOP;
+      }
+      break;
+    /* Category-3 */
+    case 2:
+      rd = ins >> 7 & 31;
+      rs1 = ins >> 15 & 31;
+      imm = (int32_t)ins >> 20;
+      switch (ins >> 2 & 31) {
+        case 0: kind = OP_ADDI; break;
+        case 1: kind = OP_ANDI; break;
+        case 2: kind = OP_ORI; break;
+        case 3: kind = OP_SLL; break;
+        case 4: kind = OP_SRA; break;
+        case 5: kind = OP_LW; break;
+      }
+      if (kind != OP_INVALID && !rd) {
+        kind = OP_NOP;
+      }
+      break;
+    /* Category-4 */
+    case 3:
+      rd = ins >> 7 & 31;
+      imm = (int32_t)ins >> 12;
+      switch (ins >> 2 & 31) {
+        case 0: kind = OP_JAL; imm = addr + (imm << 1); break;
+        case 31: kind = OP_BREAK; break;
+      }
+      break;
+  }
+  op->kind = kind;
+  op->rd = rd;
+  op->rs1 = rs1;
+  op->rs2 = rs2;
+  op->imm = imm;
+}
+
+static int predecode_program(struct program *program)
+{
+  uint32_t count = (program->mem_data - program->mem_lower) / 4;
+  struct op *ops = calloc(count, sizeof(*ops));
+  if (!ops) {
+    err("failed to allocate decoded program");
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t addr = program->mem_lower + i * 4;
+    decode_op(&ops[i], mem_peek(&program->mem, addr), addr);
+  }
+  program->ops = ops;
+  return 0;
+}
+
+/* Return the byte offset of addr into the decoded text, or -1 if outside. */
+static inline uint32_t text_offset(const struct program *program, uint32_t addr)
+{
+  uint32_t offset = addr - program->mem_lower;
+  if ((offset & 3) || offset >= program->mem_data - program->mem_lower) {
+    return -1;
+  }
+  return offset;
+}
+
+/*
+ * Return the decoded op at addr. Control flow that leaves the text segment
+ * (or lands misaligned) is decoded on the fly into tmp.
+ */
+static inline const struct op *fetch_op(const struct program *program,
+    uint32_t addr, struct op *tmp)
+{
+  uint32_t offset = text_offset(program, addr);
+  if (offset != (uint32_t)-1) {
+    return &program->ops[offset / 4];
+  }
+  decode_op(tmp, mem_peek(&program->mem, addr), addr);
+  return tmp;
+}
+
+/* Execute op. The pc must already point to the next instruction. */
+static inline void execute_op(struct program *program, const struct op *op)
+{
+  uint32_t *regs = program->regs;
+  uint32_t addr, offset;
+  switch (op->kind) {
+    case OP_BEQ:
+      if (regs[op->rs1] == regs[op->rs2]) {
+        program->pc = op->imm;
+      }
+      return;
+    case OP_BNE:
+      if (regs[op->rs1] != regs[op->rs2]) {
+        program->pc = op->imm;
+      }
+      return;
+    case OP_BLT:
+      if ((int32_t)regs[op->rs1] < (int32_t)regs[op->rs2]) {
+        program->pc = op->imm;
+      }
+      return;
+    case OP_SW:
+      addr = regs[op->rs2] + op->imm;
+      /* self-modifying code; the text is always in the flat memory */
+      if ((offset = text_offset(program, addr)) != (uint32_t)-1) {
+        *(int32_t *)(program->mem.flat + addr - 256) = regs[op->rs1];
+        decode_op(&program->ops[offset / 4], regs[op->rs1], addr);
+        return;
+      }
+      mem_store(&program->mem, addr, regs[op->rs1]);
+      return;
+    case OP_ADD:
+      regs[op->rd] = regs[op->rs1] + regs[op->rs2];
+      return;
+    case OP_SUB:
+      regs[op->rd] = regs[op->rs1] - regs[op->rs2];
+      return;
+    case OP_AND:
+      regs[op->rd] = regs[op->rs1] & regs[op->rs2];
+      return;
+    case OP_OR:
+      regs[op->rd] = regs[op->rs1] | regs[op->rs2];
+      return;
+    case OP_ADDI:
+      regs[op->rd] = regs[op->rs1] + op->imm;
+      return;
+    case OP_ANDI:
+      regs[op->rd] = regs[op->rs1] & op->imm;
+      return;
+    case OP_ORI:
+      regs[op->rd] = regs[op->rs1] | op->imm;
+      return;
+    case OP_SLL:
+      regs[op->rd] = regs[op->rs1] << op->imm;
+      return;
+    case OP_SRA:
+      regs[op->rd] = (int32_t)regs[op->rs1] >> op->imm;
+      return;
+    case OP_LW:
+      regs[op->rd] = mem_load(&program->mem, regs[op->rs1] + op->imm);
+      return;
+    case OP_JAL:
+      if (op->rd) {
+        regs[op->rd] = program->pc;
+      }
+      program->pc = op->imm;
+      return;
+    case OP_BREAK:
+      program->pc = 0;
+      return;
+  }
+}
+
+#ifdef __GNUC__
+/* superblocks start at text addresses entered this many times */
+#define SUPERBLOCK_THRESHOLD 16
+#define SUPERBLOCK_MAX 64
+#define SUPERBLOCK_SPACE (1 << 16)
+
+/* thread-only kinds, produced when forming superblocks */
+enum
+{
+  /* addi immediately followed by a branch */
+  OP_ADDI_BEQ = OP_BREAK + 1,
+  OP_ADDI_BNE,
+  OP_ADDI_BLT,
+  /* sll, add, lw: scaled address computation and load */
+  OP_SLL_ADD_LW,
+  /* jal whose target was laid out right after it */
+  OP_JAL_LINK,
+  /* continue at addr through the dispatcher */
+  OP_LEAVE,
+  OP_THREAD_KINDS,
+};
+
+struct thread_op
+{
+  const void *handler;
+  struct op op;
+  /* guest address of op */
+  uint32_t addr;
+  /* taken branch target when it is resolved ahead of time */
+  const struct thread_op *target;
+};
+
+static inline int is_branch(unsigned int kind)
+{
+  return kind == OP_BEQ || kind == OP_BNE || kind == OP_BLT;
+}
+
+/*
+ * Lay out the hot path starting at text index head contiguously in sb,
+ * starting at sb[*used]. The path follows fall-through of conditional
+ * branches and the target of jal, and fuses recurring sequences into single
+ * handlers; fused ops keep their trailing entries so that every entry still
+ * holds exactly one op. A branch back to the head jumps there directly.
+ * Returns the superblock, or NULL if sb is full.
+ */
+static struct thread_op *form_superblock(const struct program *program,
+    struct thread_op *sb, uint32_t *used, uint32_t head,
+    const void *const *handlers)
+{
+  const struct op *ops = program->ops;
+  uint32_t count = (program->mem_data - program->mem_lower) / 4;
+  uint32_t head_addr = program->mem_lower + head * 4;
+  uint32_t start = *used;
+  uint32_t n = 0;
+  uint32_t index = head;
+
+  if (start + SUPERBLOCK_MAX + 1 > SUPERBLOCK_SPACE) {
+    return NULL;
+  }
+  struct thread_op *out = sb + start;
+  while (index < count && n < SUPERBLOCK_MAX) {
+    const struct op *op = &ops[index];
+    uint32_t addr = program->mem_lower + index * 4;
+    unsigned int kind = op->kind;
+    uint32_t length = 1;
+
+    if (kind == OP_ADDI && index + 1 < count && is_branch(ops[index + 1].kind)
+        && n + 2 <= SUPERBLOCK_MAX) {
+      kind = OP_ADDI_BEQ + (ops[index + 1].kind - OP_BEQ);
+      length = 2;
+    } else if (kind == OP_SLL && index + 2 < count
+        && ops[index + 1].kind == OP_ADD && ops[index + 2].kind == OP_LW
+        && n + 3 <= SUPERBLOCK_MAX) {
+      kind = OP_SLL_ADD_LW;
+      length = 3;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+      out[n + i].handler = handlers[ops[index + i].kind];
+      out[n + i].op = ops[index + i];
+      out[n + i].addr = addr + i * 4;
+      out[n + i].target = NULL;
+    }
+    out[n].handler = handlers[kind];
+    n += length;
+    index += length;
+
+    const struct thread_op *last = &out[n - 1];
+    if (is_branch(last->op.kind) || last->op.kind == OP_JAL) {
+      if ((uint32_t)last->op.imm == head_addr) {
+        out[n - 1].target = out;
+        if (last->op.kind == OP_JAL) {
+          break;
+        }
+      } else if (last->op.kind == OP_JAL) {
+        uint32_t offset = text_offset(program, last->op.imm);
+        if (offset == (uint32_t)-1) {
+          break;
+        }
+        out[n - 1].handler = handlers[OP_JAL_LINK];
+        index = offset / 4;
+      }
+    } else if (last->op.kind == OP_BREAK) {
+      break;
+    }
+  }
+  out[n].handler = handlers[OP_LEAVE];
+  out[n].addr = index < count ? program->mem_lower + index * 4
+    : program->mem_data;
+  out[n].target = NULL;
+  *used = start + n + 1;
+  return out;
+}
+
+/*
+ * Direct-threaded interpreter: every decoded op carries the address of its
+ * handler and each handler jumps straight to the next one, so there is no
+ * central dispatch switch. Text addresses entered often enough get a
+ * superblock (see form_superblock()) that later entries run instead.
+ * Produces the same state as the execute_op() loop. Returns the number of
+ * instructions executed and stores the address of the last one in
+ * *last_addr.
+ */
+static unsigned int run_threaded(struct program *program, uint32_t *last_addr)
+{
+  static const void *const handlers[OP_THREAD_KINDS] = {
+    [OP_INVALID] = &&do_nop,
+    [OP_NOP] = &&do_nop,
+    [OP_BEQ] = &&do_beq,
+    [OP_BNE] = &&do_bne,
+    [OP_BLT] = &&do_blt,
+    [OP_SW] = &&do_sw,
+    [OP_ADD] = &&do_add,
+    [OP_SUB] = &&do_sub,
+    [OP_AND] = &&do_and,
+    [OP_OR] = &&do_or,
+    [OP_ADDI] = &&do_addi,
+    [OP_ANDI] = &&do_andi,
+    [OP_ORI] = &&do_ori,
+    [OP_SLL] = &&do_sll,
+    [OP_SRA] = &&do_sra,
+    [OP_LW] = &&do_lw,
+    [OP_JAL] = &&do_jal,
+    [OP_BREAK] = &&do_break,
+    [OP_ADDI_BEQ] = &&do_addi_beq,
+    [OP_ADDI_BNE] = &&do_addi_bne,
+    [OP_ADDI_BLT] = &&do_addi_blt,
+    [OP_SLL_ADD_LW] = &&do_sll_add_lw,
+    [OP_JAL_LINK] = &&do_jal_link,
+    [OP_LEAVE] = &&leave,
+  };
+
+  uint32_t count = (program->mem_data - program->mem_lower) / 4;
+  struct thread_op *code = malloc((count + 1) * sizeof(*code));
+  struct thread_op *sb = malloc(SUPERBLOCK_SPACE * sizeof(*sb));
+  struct thread_op **entry = calloc(count, sizeof(*entry));
+  uint32_t *hits = calloc(count, sizeof(*hits));
+  if (job) {
+    job->threaded[0] = code;
+    job->threaded[1] = sb;
+    job->threaded[2] = entry;
+    job->threaded[3] = hits;
+  }
+  if (!code || !sb || !entry || !hits) {
+    err("failed to allocate threaded code");
+    fail(1);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    code[i].handler = handlers[program->ops[i].kind];
+    code[i].op = program->ops[i];
+    code[i].addr = program->mem_lower + i * 4;
+    code[i].target = NULL;
+  }
+  /* falling off the end of the text segment */
+  code[count].handler = &&leave;
+  code[count].addr = program->mem_data;
+  code[count].target = NULL;
+  uint32_t sb_used = 0;
+
+  uint32_t *regs = program->regs;
+  struct memory *mem = &program->mem;
+  unsigned int counter = 0;
+  const struct thread_op *ip;
+  /* ops outside the text segment are decoded into tmp[0]; tmp[1] leaves */
+  struct thread_op tmp[2] = {{0}};
+  uint32_t pc = program->pc;
+  uint32_t addr, offset;
+
+  tmp[1].handler = &&leave;
+
+#define NEXT goto *(++ip)->handler
+#define JUMP(dest) do { \
+    if (ip->target) { \
+      ip = ip->target; \
+      goto *ip->handler; \
+    } \
+    if (!(pc = (dest))) { \
+      *last_addr = ip->addr; \
+      goto done; \
+    } \
+    goto enter; \
+  } while (0)
+
+enter:
+  offset = text_offset(program, pc);
+  if (offset != (uint32_t)-1) {
+    uint32_t index = offset / 4;
+    if (entry[index]) {
+      ip = entry[index];
+    } else {
+      ip = code + index;
+      if (++hits[index] >= SUPERBLOCK_THRESHOLD) {
+        entry[index] = form_superblock(program, sb, &sb_used, index, handlers);
+        if (!entry[index]) {
+          /* out of space: start over with the currently hot code */
+          sb_used = 0;
+          memset(entry, 0, count * sizeof(*entry));
+          memset(hits, 0, count * sizeof(*hits));
+        } else {
+          ip = entry[index];
+        }
+      }
+    }
+  } else {
+    decode_op(&tmp[0].op, mem_peek(mem, pc), pc);
+    tmp[0].handler = handlers[tmp[0].op.kind];
+    tmp[0].addr = pc;
+    tmp[1].addr = pc + 4;
+    ip = tmp;
+  }
+  goto *ip->handler;
+
+leave:
+  pc = ip->addr;
+  goto enter;
+
+do_nop:
+  ++counter;
+  NEXT;
+do_beq:
+  ++counter;
+  if (regs[ip->op.rs1] == regs[ip->op.rs2]) {
+    JUMP(ip->op.imm);
+  }
+  NEXT;
+do_bne:
+  ++counter;
+  if (regs[ip->op.rs1] != regs[ip->op.rs2]) {
+    JUMP(ip->op.imm);
+  }
+  NEXT;
+do_blt:
+  ++counter;
+  if ((int32_t)regs[ip->op.rs1] < (int32_t)regs[ip->op.rs2]) {
+    JUMP(ip->op.imm);
+  }
+  NEXT;
+do_sw:
+  ++counter;
+  addr = regs[ip->op.rs2] + ip->op.imm;
+  mem_store(mem, addr, regs[ip->op.rs1]);
+  /* self-modifying code */
+  if ((offset = text_offset(program, addr)) != (uint32_t)-1) {
+    struct op *op = &program->ops[offset / 4];
+    decode_op(op, regs[ip->op.rs1], addr);
+    code[offset / 4].op = *op;
+    code[offset / 4].handler = handlers[op->kind];
+    /* superblocks may hold copies of the old op */
+    if (sb_used) {
+      sb_used = 0;
+      memset(entry, 0, count * sizeof(*entry));
+      memset(hits, 0, count * sizeof(*hits));
+      if (ip >= sb && ip < sb + SUPERBLOCK_SPACE) {
+        pc = ip->addr + 4;
+        goto enter;
+      }
+    }
+  }
+  NEXT;
+do_add:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] + regs[ip->op.rs2];
+  NEXT;
+do_sub:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] - regs[ip->op.rs2];
+  NEXT;
+do_and:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] & regs[ip->op.rs2];
+  NEXT;
+do_or:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] | regs[ip->op.rs2];
+  NEXT;
+do_addi:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] + ip->op.imm;
+  NEXT;
+do_andi:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] & ip->op.imm;
+  NEXT;
+do_ori:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] | ip->op.imm;
+  NEXT;
+do_sll:
+  ++counter;
+  regs[ip->op.rd] = regs[ip->op.rs1] << ip->op.imm;
+  NEXT;
+do_sra:
+  ++counter;
+  regs[ip->op.rd] = (int32_t)regs[ip->op.rs1] >> ip->op.imm;
+  NEXT;
+do_lw:
+  ++counter;
+  regs[ip->op.rd] = mem_load(mem, regs[ip->op.rs1] + ip->op.imm);
+  NEXT;
+do_jal:
+  ++counter;
+  if (ip->op.rd) {
+    regs[ip->op.rd] = ip->addr + 4;
+  }
+  JUMP(ip->op.imm);
+do_break:
+  ++counter;
+  *last_addr = ip->addr;
+  goto done;
+do_addi_beq:
+  counter += 2;
+  regs[ip->op.rd] = regs[ip->op.rs1] + ip->op.imm;
+  ++ip;
+  if (regs[ip->op.rs1] == regs[ip->op.rs2]) {
+    JUMP(ip->op.imm);
+  }
+  NEXT;
+do_addi_bne:
+  counter += 2;
+  regs[ip->op.rd] = regs[ip->op.rs1] + ip->op.imm;
+  ++ip;
+  if (regs[ip->op.rs1] != regs[ip->op.rs2]) {
+    JUMP(ip->op.imm);
+  }
+  NEXT;
+do_addi_blt:
+  counter += 2;
+  regs[ip->op.rd] = regs[ip->op.rs1] + ip->op.imm;
+  ++ip;
+  if ((int32_t)regs[ip->op.rs1] < (int32_t)regs[ip->op.rs2]) {
+    JUMP(ip->op.imm);
+  }
+  NEXT;
+do_sll_add_lw:
+  counter += 3;
+  regs[ip[0].op.rd] = regs[ip[0].op.rs1] << ip[0].op.imm;
+  regs[ip[1].op.rd] = regs[ip[1].op.rs1] + regs[ip[1].op.rs2];
+  regs[ip[2].op.rd] = mem_load(mem, regs[ip[2].op.rs1] + ip[2].op.imm);
+  ip += 2;
+  NEXT;
+do_jal_link:
+  ++counter;
+  if (ip->op.rd) {
+    regs[ip->op.rd] = ip->addr + 4;
+  }
+  NEXT;
+
+#undef JUMP
+#undef NEXT
+
+done:
+  program->pc = 0;
+  if (job) {
+    memset(job->threaded, 0, sizeof(job->threaded));
+  }
+  free(hits);
+  free(entry);
+  free(sb);
+  free(code);
+  return counter;
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define JIT_CODE_SIZE (16 << 20)
+#define JIT_MAX_BLOCK 256
+/* enough room for the largest translation of one instruction plus exits */
+#define JIT_MAX_INSN_BYTES 192
+
+/*
+ * State shared with translated code. The register file is addressed off rdi
+ * and the flat guest memory off rsi (already biased by -256), so neither
+ * needs to be reloaded anywhere in a block or across chained blocks. Other
+ * memory is reached through a copy of the cached page; accesses that miss it
+ * leave the block with step set so the dispatcher interprets them.
+ */
+struct jit_context
+{
+  uint32_t regs[32];
+  uint64_t count;
+  uint32_t last;
+  uint32_t flush;
+  uint32_t step;
+  uint32_t page;
+  uintptr_t host;
+};
+
+typedef uint32_t (*jit_block_fn)(struct jit_context *ctx, char *base);
+
+struct jit_exit
+{
+  uint32_t site;
+  uint32_t next;
+};
+
+struct jit
+{
+  const struct program *program;
+  unsigned char *code;
+  size_t len;
+  /* text index -> translated block, or NULL */
+  unsigned char **blocks;
+  /* text index -> 1 + first exit waiting for that block, or 0 */
+  uint32_t *pending;
+  struct jit_exit *exits;
+  uint32_t exits_len;
+  uint32_t exits_size;
+};
+
+static inline void jit_emit(struct jit *jit, const void *bytes, size_t n)
+{
+  memcpy(jit->code + jit->len, bytes, n);
+  jit->len += n;
+}
+
+static inline void jit_emit8(struct jit *jit, uint8_t byte)
+{
+  jit->code[jit->len++] = byte;
+}
+
+static inline void jit_emit32(struct jit *jit, uint32_t word)
+{
+  jit_emit(jit, &word, 4);
+}
+
+/* op reg32, [rdi + 4 * r] */
+static void jit_reg_op(struct jit *jit, uint8_t opcode, unsigned int reg, unsigned int r)
+{
+  jit_emit8(jit, opcode);
+  jit_emit8(jit, 0x47 | reg << 3);
+  jit_emit8(jit, r * 4);
+}
+
+static void jit_rel32(struct jit *jit, uint32_t site, const unsigned char *target)
+{
+  int32_t rel = target - (jit->code + site + 4);
+  memcpy(jit->code + site, &rel, 4);
+}
+
+/* Leave the block after n instructions of it, continuing at target. */
+static void jit_exit(struct jit *jit, uint32_t n, uint32_t target, uint32_t from)
+{
+  /* add qword [rdi + count], n */
+  jit_emit(jit, "\x48\x81\x87", 3);
+  jit_emit32(jit, offsetof(struct jit_context, count));
+  jit_emit32(jit, n);
+  if (!target) {
+    /* mov dword [rdi + last], from; xor eax, eax; ret */
+    jit_emit(jit, "\xc7\x87", 2);
+    jit_emit32(jit, offsetof(struct jit_context, last));
+    jit_emit32(jit, from);
+    jit_emit(jit, "\x31\xc0\xc3", 3);
+    return;
+  }
+  uint32_t offset = text_offset(jit->program, target);
+  if (offset != (uint32_t)-1 && jit->blocks[offset / 4]) {
+    jit_emit8(jit, 0xe9);
+    jit->len += 4;
+    jit_rel32(jit, jit->len - 4, jit->blocks[offset / 4]);
+    return;
+  }
+  /* mov eax, target; ret -- patched into a jmp once target is translated */
+  uint32_t site = jit->len;
+  jit_emit8(jit, 0xb8);
+  jit_emit32(jit, target);
+  jit_emit8(jit, 0xc3);
+  if (offset == (uint32_t)-1) {
+    return;
+  }
+  if (jit->exits_len == jit->exits_size) {
+    uint32_t size = jit->exits_size ? jit->exits_size * 2 : 1024;
+    struct jit_exit *exits = realloc(jit->exits, size * sizeof(*exits));
+    if (!exits) {
+      /* leave it unchained */
+      return;
+    }
+    jit->exits = exits;
+    jit->exits_size = size;
+  }
+  jit->exits[jit->exits_len].site = site;
+  jit->exits[jit->exits_len].next = jit->pending[offset / 4];
+  jit->pending[offset / 4] = ++jit->exits_len;
+}
+
+/*
+ * Emit the address check of the lw/sw at addr, the n-th instruction of the
+ * block, with the guest address in eax. Falls through with the host address
+ * in rdx + rax; an access that misses the flat memory and the cached page
+ * leaves the block before the instruction. Returns the site of the rel8 that
+ * jumps over the check when the access hits the flat memory at rsi + rax.
+ */
+static uint32_t jit_mem_check(struct jit *jit, uint32_t n, uint32_t addr)
+{
+  jit_emit(jit, "\x8d\x90", 2);               /* lea edx, [rax - 256] */
+  jit_emit32(jit, -256);
+  jit_emit(jit, "\xc1\xca\x02", 3);           /* ror edx, 2 */
+  jit_emit(jit, "\x81\xfa", 2);               /* cmp edx, flat words */
+  jit_emit32(jit, jit->program->mem.flat_words);
+  jit_emit8(jit, 0x72);                       /* jb flat */
+  uint32_t flat = jit->len++;
+  jit_emit(jit, "\x89\xc2", 2);               /* mov edx, eax */
+  jit_emit(jit, "\x81\xe2", 2);               /* and edx, PAGE_MASK */
+  jit_emit32(jit, PAGE_MASK);
+  jit_emit(jit, "\x3b\x97", 2);               /* cmp edx, [rdi + page] */
+  jit_emit32(jit, offsetof(struct jit_context, page));
+  jit_emit8(jit, 0x74);                       /* je hit */
+  uint32_t hit = jit->len++;
+  /* add qword [rdi + count], n - 1; mov dword [rdi + step], 1; mov eax, addr; ret */
+  jit_emit(jit, "\x48\x81\x87", 3);
+  jit_emit32(jit, offsetof(struct jit_context, count));
+  jit_emit32(jit, n - 1);
+  jit_emit(jit, "\xc7\x87", 2);
+  jit_emit32(jit, offsetof(struct jit_context, step));
+  jit_emit32(jit, 1);
+  jit_emit8(jit, 0xb8);
+  jit_emit32(jit, addr);
+  jit_emit8(jit, 0xc3);
+  jit->code[hit] = jit->len - hit - 1;
+  jit_emit(jit, "\x48\x8b\x97", 3);           /* mov rdx, [rdi + host] */
+  jit_emit32(jit, offsetof(struct jit_context, host));
+  return flat;
+}
+
+static void jit_reset(struct jit *jit)
+{
+  uint32_t count = (jit->program->mem_data - jit->program->mem_lower) / 4;
+  jit->len = 0;
+  jit->exits_len = 0;
+  memset(jit->blocks, 0, count * sizeof(*jit->blocks));
+  memset(jit->pending, 0, count * sizeof(*jit->pending));
+}
+
+static void jit_free(struct jit *jit)
+{
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit->blocks);
+  free(jit->pending);
+  free(jit->exits);
+}
+
+/*
+ * Translate the basic block starting at text index, which ends at the first
+ * beq/bne/blt/jal/break (or after JIT_MAX_BLOCK instructions). Returns NULL
+ * if the code buffer is full.
+ */
+static unsigned char *jit_compile(struct jit *jit, uint32_t index)
+{
+  const struct program *program = jit->program;
+  if (JIT_CODE_SIZE - jit->len < (JIT_MAX_BLOCK + 1) * JIT_MAX_INSN_BYTES) {
+    return NULL;
+  }
+
+  unsigned char *start = jit->code + jit->len;
+  jit->blocks[index] = start;
+  for (uint32_t e = jit->pending[index]; e; e = jit->exits[e - 1].next) {
+    uint32_t site = jit->exits[e - 1].site;
+    jit->code[site] = 0xe9;
+    jit_rel32(jit, site + 1, start);
+  }
+  jit->pending[index] = 0;
+
+  uint32_t addr = program->mem_lower + index * 4;
+  uint32_t n = 0;
+  struct op op;
+  size_t patch, next;
+  for (;;) {
+    if (n == JIT_MAX_BLOCK || text_offset(program, addr) == (uint32_t)-1) {
+      jit_exit(jit, n, addr, 0);
+      return start;
+    }
+    decode_op(&op, mem_peek(&program->mem, addr), addr);
+    n++;
+    switch (op.kind) {
+      case OP_BEQ:
+      case OP_BNE:
+      case OP_BLT:
+        jit_reg_op(jit, 0x8b, 0, op.rs1);       /* mov eax, rs1 */
+        jit_reg_op(jit, 0x3b, 0, op.rs2);       /* cmp eax, rs2 */
+        /* jump to the not-taken exit on the inverse condition */
+        jit_emit8(jit, 0x0f);
+        jit_emit8(jit, op.kind == OP_BEQ ? 0x85 : op.kind == OP_BNE ? 0x84 : 0x8d);
+        patch = jit->len;
+        jit->len += 4;
+        jit_exit(jit, n, op.imm, addr);
+        jit_rel32(jit, patch, jit->code + jit->len);
+        jit_exit(jit, n, addr + 4, 0);
+        return start;
+      case OP_SW:
+        jit_reg_op(jit, 0x8b, 0, op.rs2);       /* mov eax, rs2 */
+        jit_emit8(jit, 0x05);                   /* add eax, imm */
+        jit_emit32(jit, op.imm);
+        patch = jit_mem_check(jit, n, addr);
+        jit_reg_op(jit, 0x8b, 1, op.rs1);       /* mov ecx, rs1 */
+        jit_emit(jit, "\x89\x0c\x02", 3);       /* mov [rdx + rax], ecx */
+        /* pages never hold text */
+        jit_emit8(jit, 0xeb);                   /* jmp next */
+        next = jit->len++;
+        jit->code[patch] = jit->len - patch - 1;
+        jit_reg_op(jit, 0x8b, 1, op.rs1);       /* mov ecx, rs1 */
+        jit_emit(jit, "\x89\x0c\x06", 3);       /* mov [rsi + rax], ecx */
+        /* stores into the text segment invalidate all translations */
+        jit_emit(jit, "\x89\xc2", 2);           /* mov edx, eax */
+        jit_emit(jit, "\x81\xea", 2);           /* sub edx, mem_lower */
+        jit_emit32(jit, program->mem_lower);
+        jit_emit(jit, "\x81\xfa", 2);           /* cmp edx, text size */
+        jit_emit32(jit, program->mem_data - program->mem_lower);
+        jit_emit(jit, "\x73", 1);               /* jae over the exit */
+        patch = jit->len++;
+        jit_emit(jit, "\xc7\x87", 2);           /* mov dword [rdi + flush], 1 */
+        jit_emit32(jit, offsetof(struct jit_context, flush));
+        jit_emit32(jit, 1);
+        /* add qword [rdi + count], n; mov eax, addr + 4; ret */
+        jit_emit(jit, "\x48\x81\x87", 3);
+        jit_emit32(jit, offsetof(struct jit_context, count));
+        jit_emit32(jit, n);
+        jit_emit8(jit, 0xb8);
+        jit_emit32(jit, addr + 4);
+        jit_emit8(jit, 0xc3);
+        jit->code[patch] = jit->len - patch - 1;
+        jit->code[next] = jit->len - next - 1;
+        break;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_OR:
+        jit_reg_op(jit, 0x8b, 0, op.rs1);
+        jit_reg_op(jit,
+            op.kind == OP_ADD ? 0x03 : op.kind == OP_SUB ? 0x2b
+            : op.kind == OP_AND ? 0x23 : 0x0b, 0, op.rs2);
+        jit_reg_op(jit, 0x89, 0, op.rd);
+        break;
+      case OP_ADDI:
+      case OP_ANDI:
+      case OP_ORI:
+        jit_reg_op(jit, 0x8b, 0, op.rs1);
+        jit_emit8(jit, op.kind == OP_ADDI ? 0x05 : op.kind == OP_ANDI ? 0x25 : 0x0d);
+        jit_emit32(jit, op.imm);
+        jit_reg_op(jit, 0x89, 0, op.rd);
+        break;
+      case OP_SLL:
+      case OP_SRA:
+        /* the hardware masks the count exactly like the interpreter's shifts */
+        jit_reg_op(jit, 0x8b, 0, op.rs1);
+        jit_emit8(jit, 0xc1);
+        jit_emit8(jit, op.kind == OP_SLL ? 0xe0 : 0xf8);
+        jit_emit8(jit, op.imm & 31);
+        jit_reg_op(jit, 0x89, 0, op.rd);
+        break;
+      case OP_LW:
+        jit_reg_op(jit, 0x8b, 0, op.rs1);
+        jit_emit8(jit, 0x05);
+        jit_emit32(jit, op.imm);
+        patch = jit_mem_check(jit, n, addr);
+        jit_emit(jit, "\x8b\x04\x02", 3);       /* mov eax, [rdx + rax] */
+        jit_emit8(jit, 0xeb);                   /* jmp next */
+        next = jit->len++;
+        jit->code[patch] = jit->len - patch - 1;
+        jit_emit(jit, "\x8b\x04\x06", 3);       /* mov eax, [rsi + rax] */
+        jit->code[next] = jit->len - next - 1;
+        jit_reg_op(jit, 0x89, 0, op.rd);
+        break;
+      case OP_JAL:
+        if (op.rd) {
+          jit_emit(jit, "\xc7\x47", 2);         /* mov dword [rdi + 4 * rd], addr + 4 */
+          jit_emit8(jit, op.rd * 4);
+          jit_emit32(jit, addr + 4);
+        }
+        jit_exit(jit, n, op.imm, addr);
+        return start;
+      case OP_BREAK:
+        jit_exit(jit, n, 0, addr);
+        return start;
+    }
+    addr += 4;
+  }
+}
+
+/*
+ * Run to break with text-segment basic blocks translated to x86-64. Anything
+ * executed outside the text segment is interpreted one instruction at a time.
+ * Returns -1 if no executable memory is available.
+ */
+static int run_jit(struct program *program, unsigned int *counter, uint32_t *last_addr)
+{
+  uint32_t count = (program->mem_data - program->mem_lower) / 4;
+  struct jit jit;
+  memset(&jit, 0, sizeof(jit));
+  jit.program = program;
+  jit.code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit.code == MAP_FAILED) {
+    err_sys("failed to map JIT code buffer");
+    return -1;
+  }
+  jit.blocks = calloc(count, sizeof(*jit.blocks));
+  jit.pending = calloc(count, sizeof(*jit.pending));
+  if (job) {
+    job->jit = &jit;
+  }
+  if (!jit.blocks || !jit.pending) {
+    err("failed to allocate JIT block cache");
+    fail(1);
+  }
+
+  struct jit_context ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  memcpy(ctx.regs, program->regs, sizeof(ctx.regs));
+  char *base = program->mem.flat - 256;
+  uint32_t pc = program->pc;
+  ctx.page = program->mem.page;
+  ctx.host = program->mem.host;
+
+  while (pc) {
+    uint32_t offset = text_offset(program, pc);
+    if (offset == (uint32_t)-1 || ctx.step) {
+      struct op op;
+      ctx.step = 0;
+      decode_op(&op, mem_peek(&program->mem, pc), pc);
+      uint32_t store = ctx.regs[op.rs2] + op.imm;
+      memcpy(program->regs, ctx.regs, sizeof(ctx.regs));
+      program->pc = pc + 4;
+      execute_op(program, &op);
+      memcpy(ctx.regs, program->regs, sizeof(ctx.regs));
+      if (op.kind == OP_SW && text_offset(program, store) != (uint32_t)-1) {
+        jit_reset(&jit);
+      }
+      ctx.count++;
+      ctx.last = pc;
+      ctx.page = program->mem.page;
+      ctx.host = program->mem.host;
+      pc = program->pc;
+      continue;
+    }
+    unsigned char *entry = jit.blocks[offset / 4];
+    if (!entry && !(entry = jit_compile(&jit, offset / 4))) {
+      jit_reset(&jit);
+      entry = jit_compile(&jit, offset / 4);
+    }
+    pc = ((jit_block_fn)entry)(&ctx, base);
+    if (ctx.flush) {
+      ctx.flush = 0;
+      jit_reset(&jit);
+    }
+  }
+
+  memcpy(program->regs, ctx.regs, sizeof(ctx.regs));
+  program->pc = 0;
+  /* translated code does not maintain the decoded ops */
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t addr = program->mem_lower + i * 4;
+    decode_op(&program->ops[i], mem_peek(&program->mem, addr), addr);
+  }
+  *counter = ctx.count;
+  *last_addr = ctx.last;
+  if (job) {
+    job->jit = NULL;
+  }
+  jit_free(&jit);
+  return 0;
+}
+#endif
+
+static void disassemble_to(struct writer *out, struct program *program)
+{
+  for (uint32_t addr = program->mem_lower; addr < program->mem_upper; addr += 4) {
+    uint32_t word = mem_peek(&program->mem, addr);
+    write_bin32(out, word);
+    writer_putc(out, '\t');
+    writer_uint(out, addr);
+    writer_putc(out, '\t');
+    if (addr < program->mem_data) {
+      disassemble_instruction(out, word);
+    } else {
+      writer_int(out, word);
+    }
+    writer_putc(out, '\n');
+  }
+}
+
+static int disassemble(const char *filename, struct program *program)
+{
+  struct writer out;
+  if (writer_open(&out, filename)) {
+    return 1;
+  }
+  disassemble_to(&out, program);
+  return writer_close(&out) ? 1 : 0;
+}
+
+static const char register_labels[4][6] = { "\nx00:", "\nx08:", "\nx16:", "\nx24:" };
+
+static void write_cycle(struct writer *out, const struct program *program,
+    unsigned int counter, uint32_t addr, uint32_t ins)
+{
+  uint32_t data_size = program->mem_upper - program->mem_data;
+  writer_puts(out,
+      "--------------------\n"
+      "Cycle ");
+  writer_uint(out, counter);
+  writer_puts(out, ":\t");
+  writer_uint(out, addr);
+  writer_putc(out, '\t');
+  disassemble_instruction(out, ins);
+  writer_puts(out, "\nRegisters");
+  for (unsigned int r = 0; r < 32; r++) {
+    if ((r & 7) == 0) {
+      writer_write(out, register_labels[r / 8], 5);
+    }
+    writer_putc(out, '\t');
+    writer_int(out, program->regs[r]);
+  }
+  writer_puts(out, "\nData");
+  for (uint32_t offset = 0; offset < data_size; offset += 4) {
+    uint32_t mem_addr = program->mem_data + offset;
+    if ((offset & 31) == 0) {
+      writer_putc(out, '\n');
+      writer_uint(out, mem_addr);
+      writer_putc(out, ':');
+    }
+    writer_putc(out, '\t');
+    writer_int(out, mem_peek(&program->mem, mem_addr));
+  }
+  writer_putc(out, '\n');
+}
+
+enum
+{
+  TRACE_NONE,
+  TRACE_FULL,
+  TRACE_DELTA,
+};
+
+/* execution engines; only untraced runs use anything but the reference */
+enum
+{
+  ENGINE_SWITCH,
+  ENGINE_THREADED,
+  ENGINE_JIT,
+};
+
+#define DELTA_MAGIC "Vsim delta 1\n"
+#define DELTA_KEYFRAME_INTERVAL 4096
+
+/*
+ * Delta trace records, one per line:
+ *
+ *   K <cycle> <addr> <ins> <mem_data> <mem_upper> <x0>..<x31> <data words>
+ *   <addr> <ins> [r<n>=<value>] [@<addr>=<value>]
+ *
+ * The first form is a keyframe holding the complete state after that cycle;
+ * the second holds only what the cycle changed.
+ */
+static void write_keyframe(struct writer *out, const struct program *program,
+    unsigned int counter, uint32_t addr, uint32_t ins)
+{
+  writer_puts(out, "K ");
+  writer_uint(out, counter);
+  writer_putc(out, ' ');
+  writer_uint(out, addr);
+  writer_putc(out, ' ');
+  writer_uint(out, ins);
+  writer_putc(out, ' ');
+  writer_uint(out, program->mem_data);
+  writer_putc(out, ' ');
+  writer_uint(out, program->mem_upper);
+  for (unsigned int r = 0; r < 32; r++) {
+    writer_putc(out, ' ');
+    writer_int(out, program->regs[r]);
+  }
+  for (uint32_t mem_addr = program->mem_data; mem_addr < program->mem_upper; mem_addr += 4) {
+    writer_putc(out, ' ');
+    writer_int(out, mem_peek(&program->mem, mem_addr));
+  }
+  writer_putc(out, '\n');
+}
+
+static void write_delta(struct writer *out, const struct program *program,
+    const struct op *op, uint32_t addr, uint32_t ins,
+    uint32_t old_reg, int32_t old_word)
+{
+  writer_uint(out, addr);
+  writer_putc(out, ' ');
+  writer_uint(out, ins);
+  if (program->regs[op->rd] != old_reg) {
+    writer_puts(out, " r");
+    writer_uint(out, op->rd);
+    writer_putc(out, '=');
+    writer_int(out, program->regs[op->rd]);
+  }
+  if (op->kind == OP_SW) {
+    uint32_t mem_addr = program->regs[op->rs2] + op->imm;
+    int32_t word = mem_peek(&program->mem, mem_addr);
+    if (mem_addr - program->mem_data < program->mem_upper - program->mem_data
+        && word != old_word) {
+      writer_puts(out, " @");
+      writer_uint(out, mem_addr);
+      writer_putc(out, '=');
+      writer_int(out, word);
+    }
+  }
+  writer_putc(out, '\n');
+}
+
+/*
+ * Run until break. trace is always a constant at the call site so that each
+ * instance only carries the formatting code it needs; without tracing only
+ * the final cycle is written.
+ */
+static inline __attribute__((always_inline))
+void run_to(struct writer *out, struct program *program, int trace)
+{
+  unsigned int counter = 0;
+  uint32_t addr = 0;
+  struct op tmp;
+  while (program->pc) {
+    addr = program->pc;
+    const struct op *op = fetch_op(program, addr, &tmp);
+    uint32_t ins = trace ? mem_peek(&program->mem, addr) : 0;
+    uint32_t old_reg = 0;
+    int32_t old_word = 0;
+    if (trace == TRACE_DELTA) {
+      old_reg = program->regs[op->rd];
+      if (op->kind == OP_SW) {
+        old_word = mem_peek(&program->mem, program->regs[op->rs2] + op->imm);
+      }
+    }
+    ++counter;
+    program->pc += 4;
+    execute_op(program, op);
+    if (trace == TRACE_FULL) {
+      write_cycle(out, program, counter, addr, ins);
+    } else if (trace == TRACE_DELTA) {
+      if (counter % DELTA_KEYFRAME_INTERVAL == 1) {
+        write_keyframe(out, program, counter, addr, ins);
+      } else {
+        write_delta(out, program, op, addr, ins, old_reg, old_word);
+      }
+    }
+  }
+  if (trace == TRACE_NONE && counter) {
+    write_cycle(out, program, counter, addr, mem_peek(&program->mem, addr));
+  }
+}
+
+static void simulate_to(struct writer *out, struct program *program,
+    int trace, int engine)
+{
+  switch (trace) {
+    case TRACE_NONE:
+#if defined(__x86_64__) && defined(__GNUC__)
+      if (engine == ENGINE_JIT) {
+        uint32_t addr = 0;
+        unsigned int counter = 0;
+        if (!run_jit(program, &counter, &addr)) {
+          if (counter) {
+            write_cycle(out, program, counter, addr, mem_peek(&program->mem, addr));
+          }
+          break;
+        }
+        engine = ENGINE_THREADED;
+      }
+#endif
+#ifdef __GNUC__
+      if (engine == ENGINE_THREADED) {
+        uint32_t addr = 0;
+        unsigned int counter = run_threaded(program, &addr);
+        if (counter) {
+          write_cycle(out, program, counter, addr, mem_peek(&program->mem, addr));
+        }
+        break;
+      }
+#endif
+      run_to(out, program, TRACE_NONE);
+      break;
+    case TRACE_FULL:
+      run_to(out, program, TRACE_FULL);
+      break;
+    case TRACE_DELTA:
+      writer_puts(out, DELTA_MAGIC);
+      run_to(out, program, TRACE_DELTA);
+      break;
+  }
+}
+
+/* With expected set, verify the output against it instead of writing it. */
+static int simulate(const char *filename, const char *expected,
+    struct program *program, int trace, int engine)
+{
+  struct writer out;
+  if (expected ? writer_open_verify(&out, expected)
+      : writer_open(&out, filename)) {
+    return 1;
+  }
+  if (job) {
+    job->out = &out;
+  }
+  simulate_to(&out, program, trace, engine);
+  if (job) {
+    job->out = NULL;
+  }
+  return writer_close(&out) ? 1 : 0;
+}
+
+static void fail(int status)
+{
+  if (!job) {
+    exit(status);
+  }
+  /* batches never verify, so the trace is a plain file */
+  if (job->out) {
+    close(job->out->fd);
+    free(job->out->buf);
+  }
+  for (int i = 0; i < 4; i++) {
+    free(job->threaded[i]);
+  }
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (job->jit) {
+    jit_free(job->jit);
+  }
+#endif
+  longjmp(job->env, status);
+}
+
+/*
+ * simulate() input as this_job, so that an error fails only this input.
+ * this_job and program must outlive the frame, as longjmp() leaves its
+ * locals indeterminate.
+ */
+static int simulate_job(struct job *this_job, const char *input,
+    const char *filename, struct program *program, int trace, int engine)
+{
+  memset(this_job, 0, sizeof(*this_job));
+  if (setjmp(this_job->env)) {
+    job = NULL;
+    err("'%s' failed; the batch goes on", input);
+    return 1;
+  }
+  job = this_job;
+  int ret = simulate(filename, NULL, program, trace, engine);
+  job = NULL;
+  return ret;
+}
+
+/* Parse a decimal integer at *cur, skipping leading blanks. */
+static int scan_int(const char **cur, const char *end, int64_t *value)
+{
+  const char *p = *cur;
+  int neg = 0;
+  int64_t v = 0;
+  while (p < end && *p == ' ') {
+    p++;
+  }
+  if (p < end && *p == '-') {
+    neg = 1;
+    p++;
+  }
+  if (p == end || *p < '0' || *p > '9') {
+    return -1;
+  }
+  while (p < end && *p >= '0' && *p <= '9') {
+    v = v * 10 + (*p++ - '0');
+  }
+  *value = neg ? -v : v;
+  *cur = p;
   return 0;
 }
+
+static int expand_to(struct writer *out, const char *cur, const char *end)
+{
+  struct program program;
+  unsigned int counter = 0;
+  int64_t v[6];
+  int ret = -1;
+
+  memset(&program, 0, sizeof(program));
+  if ((size_t)(end - cur) < sizeof(DELTA_MAGIC) - 1
+      || memcmp(cur, DELTA_MAGIC, sizeof(DELTA_MAGIC) - 1)) {
+    err("not a delta trace");
+    return -1;
+  }
+  cur += sizeof(DELTA_MAGIC) - 1;
+
+  while (cur < end) {
+    uint32_t addr, ins;
+    if (*cur == 'K') {
+      cur++;
+      for (int i = 0; i < 5; i++) {
+        if (scan_int(&cur, end, &v[i])) {
+          goto malformed;
+        }
+      }
+      counter = v[0];
+      addr = v[1];
+      ins = v[2];
+      if (!program.mem.flat) {
+        if (v[3] < 256 || v[4] < v[3] || v[4] > MEM_LIMIT || (v[4] - v[3]) & 3) {
+          goto malformed;
+        }
+        program.mem_lower = 256;
+        program.mem_data = v[3];
+        program.mem_upper = v[4];
+        program.mem_size = v[4] - 256;
+        char *flat = calloc(1, program.mem_size ? program.mem_size : 1);
+        if (!flat) {
+          err("failed to allocate program memory");
+          goto done;
+        }
+        memory_init(&program.mem, flat, program.mem_size);
+      } else if (v[3] != program.mem_data || v[4] != program.mem_upper) {
+        goto malformed;
+      }
+      for (unsigned int r = 0; r < 32; r++) {
+        if (scan_int(&cur, end, &v[0])) {
+          goto malformed;
+        }
+        program.regs[r] = v[0];
+      }
+      for (uint32_t a = program.mem_data; a < program.mem_upper; a += 4) {
+        if (scan_int(&cur, end, &v[0])) {
+          goto malformed;
+        }
+        mem_store(&program.mem, a, v[0]);
+      }
+    } else {
+      if (!program.mem.flat || scan_int(&cur, end, &v[0]) || scan_int(&cur, end, &v[1])) {
+        goto malformed;
+      }
+      counter++;
+      addr = v[0];
+      ins = v[1];
+      while (cur < end && *cur == ' ') {
+        cur++;
+        if (cur < end && *cur == 'r') {
+          cur++;
+          if (scan_int(&cur, end, &v[0]) || v[0] < 0 || v[0] > 31
+              || cur == end || *cur++ != '=' || scan_int(&cur, end, &v[1])) {
+            goto malformed;
+          }
+          program.regs[v[0]] = v[1];
+        } else if (cur < end && *cur == '@') {
+          cur++;
+          if (scan_int(&cur, end, &v[0])
+              || v[0] < program.mem_data || v[0] >= program.mem_upper
+              || cur == end || *cur++ != '=' || scan_int(&cur, end, &v[1])) {
+            goto malformed;
+          }
+          mem_store(&program.mem, v[0], v[1]);
+        } else {
+          goto malformed;
+        }
+      }
+    }
+    if (cur == end || *cur++ != '\n') {
+      goto malformed;
+    }
+    write_cycle(out, &program, counter, addr, ins);
+  }
+  ret = 0;
+  goto done;
+
+malformed:
+  err("malformed delta trace after cycle %u", counter);
+done:
+  free(program.mem.flat);
+  return ret;
+}
+
+/* Regenerate the full text trace from a delta trace. */
+static int expand(const char *input, const char *output,
+    const char *expected)
+{
+  int fd = open(input, O_RDONLY);
+  if (fd < 0) {
+    err_sys("failed to open '%s'", input);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    err_sys("fstat");
+    close(fd);
+    return 1;
+  }
+  const char *data = "";
+  if (st.st_size) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      err_sys("mmap");
+      close(fd);
+      return 1;
+    }
+  }
+  close(fd);
+
+  struct writer out;
+  int ret = 1;
+  if (!(expected ? writer_open_verify(&out, expected)
+      : writer_open(&out, output))) {
+    ret = expand_to(&out, data, data + st.st_size) ? 1 : 0;
+    if (writer_close(&out)) {
+      ret = 1;
+    }
+  }
+  if (st.st_size) {
+    munmap((void *)data, st.st_size);
+  }
+  return ret;
+}
+
+/*
+ * Batch mode: every input is simulated independently and writes its
+ * results next to it (or into outdir) as <input>.disassembly.txt and
+ * <input>.simulation.txt. Inputs are split evenly across the workers up
+ * front; a worker takes its own inputs from the front of its range and,
+ * once that is empty, steals from the back of the others'.
+ */
+struct batch_queue
+{
+  pthread_mutex_t lock;
+  /* inputs [head, tail) have not been taken yet */
+  size_t head;
+  size_t tail;
+};
+
+struct batch
+{
+  char **inputs;
+  size_t count;
+  const char *outdir;
+  int cache;
+  int trace;
+  int engine;
+  unsigned int workers;
+  struct batch_queue *queues;
+  pthread_mutex_t lock;
+  unsigned int failed;
+};
+
+struct batch_worker
+{
+  struct batch *batch;
+  unsigned int id;
+  pthread_t thread;
+  /* the input being run and its job, off the stack for simulate_job() */
+  struct program program;
+  struct job job;
+};
+
+static int batch_take(struct batch *batch, unsigned int id, size_t *index)
+{
+  struct batch_queue *own = &batch->queues[id];
+  int found = 0;
+  pthread_mutex_lock(&own->lock);
+  if (own->head < own->tail) {
+    *index = own->head++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&own->lock);
+  for (unsigned int i = 1; !found && i < batch->workers; i++) {
+    struct batch_queue *victim = &batch->queues[(id + i) % batch->workers];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      *index = --victim->tail;
+      found = 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return found;
+}
+
+/* Return a malloc'd path for output name of input. */
+static char *output_path(const char *input, const char *outdir,
+    const char *name)
+{
+  size_t len;
+  char *path;
+  if (outdir) {
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    len = strlen(outdir) + strlen(base) + strlen(name) + 3;
+    path = malloc(len);
+    if (path) {
+      snprintf(path, len, "%s/%s.%s", outdir, base, name);
+    }
+  } else {
+    len = strlen(input) + strlen(name) + 2;
+    path = malloc(len);
+    if (path) {
+      snprintf(path, len, "%s.%s", input, name);
+    }
+  }
+  if (!path) {
+    err("failed to allocate output path");
+  }
+  return path;
+}
+
+static int batch_run(struct batch_worker *worker, const char *input)
+{
+  const struct batch *batch = worker->batch;
+  struct program *program = &worker->program;
+  char *image_path = NULL;
+  char *disassembly_path = output_path(input, batch->outdir,
+      disassembly_filename);
+  char *simulation_path = output_path(input, batch->outdir,
+      batch->trace == TRACE_DELTA ? delta_filename : simulation_filename);
+  int ret = 1;
+  if (!disassembly_path || !simulation_path) {
+    goto out;
+  }
+  if (batch->cache && !(image_path = output_path(input, NULL, "img"))) {
+    goto out;
+  }
+
+  if (init_program(program, input, image_path)) {
+    goto out;
+  }
+  if (!predecode_program(program)) {
+    ret = disassemble(disassembly_path, program);
+    ret |= simulate_job(&worker->job, input, simulation_path, program,
+        batch->trace, batch->engine);
+  }
+  free_program(program);
+
+out:
+  free(image_path);
+  free(simulation_path);
+  free(disassembly_path);
+  return ret;
+}
+
+static void *batch_worker(void *arg)
+{
+  struct batch_worker *worker = arg;
+  struct batch *batch = worker->batch;
+  size_t index;
+  while (batch_take(batch, worker->id, &index)) {
+    if (batch_run(worker, batch->inputs[index])) {
+      pthread_mutex_lock(&batch->lock);
+      batch->failed++;
+      pthread_mutex_unlock(&batch->lock);
+    }
+  }
+  return NULL;
+}
+
+/* Returns the number of inputs that failed, or -1. */
+static int run_batch(struct batch *batch)
+{
+  if (batch->workers > batch->count) {
+    batch->workers = batch->count ? batch->count : 1;
+  }
+  struct batch_worker *workers = calloc(batch->workers, sizeof(*workers));
+  batch->queues = calloc(batch->workers, sizeof(*batch->queues));
+  if (!workers || !batch->queues) {
+    err("failed to allocate workers");
+    return -1;
+  }
+  pthread_mutex_init(&batch->lock, NULL);
+  batch->failed = 0;
+  for (unsigned int i = 0; i < batch->workers; i++) {
+    pthread_mutex_init(&batch->queues[i].lock, NULL);
+    batch->queues[i].head = batch->count * i / batch->workers;
+    batch->queues[i].tail = batch->count * (i + 1) / batch->workers;
+    workers[i].batch = batch;
+    workers[i].id = i;
+  }
+
+  /* the calling thread is worker 0; others steal whatever is not started */
+  unsigned int started = 1;
+  for (; started < batch->workers; started++) {
+    int error = pthread_create(&workers[started].thread, NULL, batch_worker,
+        &workers[started]);
+    if (error) {
+      errno = error;
+      err_sys("pthread_create");
+      break;
+    }
+  }
+  batch_worker(&workers[0]);
+  for (unsigned int i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  for (unsigned int i = 0; i < batch->workers; i++) {
+    pthread_mutex_destroy(&batch->queues[i].lock);
+  }
+  pthread_mutex_destroy(&batch->lock);
+  free(batch->queues);
+  free(workers);
+  return batch->failed;
+}
+
+/* Append the lines of list (or stdin for "-") to *inputs. */
+static int read_input_list(const char *list, char ***inputs, size_t *count)
+{
+  FILE *file = strcmp(list, "-") ? fopen(list, "r") : stdin;
+  if (!file) {
+    err_sys("failed to open '%s'", list);
+    return -1;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int ret = 0;
+  while ((len = getline(&line, &cap, file)) != -1) {
+    if (len && line[len - 1] == '\n') {
+      line[--len] = 0;
+    }
+    if (!len) {
+      continue;
+    }
+    char **grown = realloc(*inputs, (*count + 1) * sizeof(**inputs));
+    char *input = strdup(line);
+    if (!grown || !input) {
+      if (grown) {
+        *inputs = grown;
+      }
+      free(input);
+      err("failed to allocate input list");
+      ret = -1;
+      break;
+    }
+    *inputs = grown;
+    (*inputs)[(*count)++] = input;
+  }
+  if (!ret && ferror(file)) {
+    err_sys("failed to read '%s'", list);
+    ret = -1;
+  }
+  free(line);
+  if (file != stdin) {
+    fclose(file);
+  }
+  return ret;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+      "usage: Vsim [-c] [-e engine] [-q|-d] [-v expected] <input>\n"
+      "       Vsim [-c] [-e engine] [-q|-d] [-j jobs] [-L list] [-o dir] <input>...\n"
+      "       Vsim [-v expected] -x <delta>\n"
+      "  -c  cache the parsed program in <input>.img and reuse it\n"
+      "  -e  execution engine for -q runs: switch (default), threaded, jit\n"
+      "  -q  write only the final cycle to simulation.txt\n"
+      "  -d  write a delta trace to simulation.delta\n"
+      "  -j  batch mode: simulate the inputs on this many threads\n"
+      "      (default: one per online CPU) and write <input>.disassembly.txt\n"
+      "      and <input>.simulation.txt for each\n"
+      "  -L  batch mode: also read inputs, one per line, from list (- for stdin)\n"
+      "  -o  batch mode: write the per-input outputs into dir\n"
+      "  -v  compare the trace with expected instead of writing it and\n"
+      "      report the first cycle that differs\n"
+      "  -x  expand a delta trace into simulation.txt\n");
+}
+
+int main(int argc, char **argv)
+{
+  int trace = TRACE_FULL;
+  int expand_mode = 0;
+  int cache = 0;
+  int engine = ENGINE_SWITCH;
+  int batch_mode = 0;
+  long jobs = 0;
+  const char *outdir = NULL;
+  const char *expected = NULL;
+  char **inputs = NULL;
+  size_t count = 0;
+  int lists = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "ce:qdj:L:o:v:x")) != -1) {
+    switch (opt) {
+      case 'c':
+        cache = 1;
+        break;
+      case 'e':
+        if (!strcmp(optarg, "switch")) {
+          engine = ENGINE_SWITCH;
+        } else if (!strcmp(optarg, "threaded")) {
+          engine = ENGINE_THREADED;
+        } else if (!strcmp(optarg, "jit")) {
+          engine = ENGINE_JIT;
+        } else {
+          err("unknown engine '%s'", optarg);
+          return 2;
+        }
+        break;
+      case 'q':
+        trace = TRACE_NONE;
+        break;
+      case 'd':
+        trace = TRACE_DELTA;
+        break;
+      case 'j': {
+        char *end;
+        jobs = strtol(optarg, &end, 10);
+        if (end == optarg || *end || jobs < 1) {
+          err("invalid job count '%s'", optarg);
+          return 2;
+        }
+        batch_mode = 1;
+        break;
+      }
+      case 'L':
+        if (read_input_list(optarg, &inputs, &count)) {
+          return 1;
+        }
+        lists++;
+        batch_mode = 1;
+        break;
+      case 'o':
+        outdir = optarg;
+        batch_mode = 1;
+        break;
+      case 'v':
+        expected = optarg;
+        break;
+      case 'x':
+        expand_mode = 1;
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+  if (argc - optind > 1) {
+    batch_mode = 1;
+  }
+  if (batch_mode ? expand_mode || expected || (optind == argc && !lists)
+      : optind != argc - 1) {
+    usage();
+    return 2;
+  }
+
+  if (expand_mode) {
+    return expand(argv[optind], simulation_filename, expected);
+  }
+
+  if (batch_mode) {
+    char **all = realloc(inputs, (count + argc - optind) * sizeof(*inputs));
+    if (!all && count + argc - optind) {
+      err("failed to allocate input list");
+      return 1;
+    }
+    inputs = all;
+    for (int i = optind; i < argc; i++) {
+      inputs[count++] = argv[i];
+    }
+    if (!jobs) {
+      jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    struct batch batch = {
+      .inputs = inputs,
+      .count = count,
+      .outdir = outdir,
+      .cache = cache,
+      .trace = trace,
+      .engine = engine,
+      .workers = jobs > 0 ? jobs : 1,
+    };
+    return run_batch(&batch) ? 1 : 0;
+  }
+
+  char *image_path = NULL;
+  if (cache) {
+    size_t len = strlen(argv[optind]) + sizeof(".img");
+    image_path = malloc(len);
+    if (!image_path) {
+      err("failed to allocate image path");
+      return 1;
+    }
+    snprintf(image_path, len, "%s.img", argv[optind]);
+  }
+
+  struct program program;
+  if (init_program(&program, argv[optind], image_path)
+      || predecode_program(&program)) {
+    return 1;
+  }
+  free(image_path);
+
+  disassemble(disassembly_filename, &program);
+  return simulate(trace == TRACE_DELTA ? delta_filename : simulation_filename,
+      expected, &program, trace, engine);
+}
@@ -9,16 +9,32 @@
 /* On my honor, I have neither given nor received
  * unauthorized aid on this assignment. */
 
+/* for memfd_create() */
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define OP_beq  0
 #define OP_bne  4
 #define OP_blt  8
@@ -43,24 +59,249 @@
 #define imm1(ins) (((ins) >> 7 & 31) | ((ins) >> 20 & ~31))
 #define imm3(ins) ((ins) >> 20)
 #define imm4(ins) ((ins) >> 12)
-#define mem32(addr) mem[((addr) - 256) >> 2]
-
-static int32_t
-  *mem, mem_data, mem_end,
-  pc = 256,
-  pre_issue[4],
-  pre_alu1_ins, pre_alu1_addr, pre_alu1_val,
-  pre_alu1_ins2, pre_alu1_addr2, pre_alu1_val2,
-  pre_alu2_ins, pre_alu2_lhs, pre_alu2_rhs,
-  pre_alu2_ins2, pre_alu2_lhs2, pre_alu2_rhs2,
-  pre_alu3_ins, pre_alu3_lhs, pre_alu3_rhs,
-  pre_alu3_ins2, pre_alu3_lhs2, pre_alu3_rhs2,
-  post_alu2_ins, post_alu2_val,
-  post_alu3_ins, post_alu3_val,
-  pre_mem_ins, pre_mem_addr, pre_mem_val,
-  post_mem_ins, post_mem_val,
-  regs[32],
-  willwrite;
+/* a word of the loaded image; guest accesses go through mem_load and mem_store */
+#define mem32(m, addr) (m)->mem[((addr) - 256) >> 2]
+
+/* guest memory past the image comes in pages allocated on first store */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+/* each page table covers this much of the address space */
+#define TABLE_SHIFT 22
+#define TABLE_PAGES (1 << (TABLE_SHIFT - PAGE_SHIFT))
+/* guest addresses are [256, MEM_LIMIT); anything else is out of range */
+#define MEM_LIMIT 0x80000000u
+/* the page and alignment bits of an address; no masked address is PAGE_NONE */
+#define PAGE_MASK (~(uint32_t)(PAGE_SIZE - 1) | 3)
+#define PAGE_NONE 4
+
+#define TRACE_NONE  0
+#define TRACE_FULL  1
+#define TRACE_DELTA 2
+#define TRACE_BINARY 3
+/* TRACE_FULL, rendered by formatter threads fed through a trace_pipe */
+#define TRACE_PIPE   4
+
+#define DELTA_MAGIC "Vsim pipeline delta 1\n"
+#define DELTA_KEYFRAME_INTERVAL 4096
+#define NSLOTS 13
+
+/* cycles between checks for a pipeline that can never move again */
+#define STUCK_INTERVAL 1024
+
+#define BINARY_MAGIC "VSIMTRC1"
+
+/*
+ * Binary traces are a header, the initial data segment, and then one
+ * fixed-size record per cycle in host byte order, so cycle n (counting from
+ * 1) starts at sizeof(header) + data size + (n - 1) * sizeof(record).
+ * Records carry the store performed that cycle, if any (store_addr == 0
+ * otherwise); the data segment at cycle n is the initial image with the
+ * stores of cycles 1..n applied.
+ */
+struct trace_header {
+  char magic[8];
+  uint32_t record_size;
+  int32_t mem_data, mem_end;
+  uint32_t reserved;
+};
+
+struct trace_record {
+  int32_t cycle;
+  int32_t waiting, executed;
+  int32_t pre_issue[4];
+  int32_t pre_alu1_ins, pre_alu1_addr, pre_alu1_val;
+  int32_t pre_mem_ins, pre_mem_addr, pre_mem_val;
+  int32_t post_mem_ins, post_mem_val;
+  int32_t pre_alu2_ins, pre_alu2_lhs, pre_alu2_rhs;
+  int32_t post_alu2_ins, post_alu2_val;
+  int32_t pre_alu3_ins, pre_alu3_lhs, pre_alu3_rhs;
+  int32_t post_alu3_ins, post_alu3_val;
+  int32_t regs[32];
+  int32_t store_addr, store_val;
+  int32_t reserved;
+};
+
+/* classes of functional unit; each ALU1 unit feeds a MEM unit of its own */
+enum { ALU1, ALU2, ALU3 };
+
+/* why an instruction stayed in the pre-issue queue, in order of precedence */
+enum { STALL_ALU1, STALL_ALU2, STALL_ALU3, STALL_RAW, STALL_WAW, STALL_WAR, STALL_STORE, NSTALLS };
+
+/* the largest pipeline -m can configure */
+#define MAX_FETCH 8
+#define MAX_PRE_ISSUE 128
+#define MAX_UNITS 4
+#define MAX_DEPTH 8
+#define MAX_ISSUE (3 * MAX_UNITS)
+#define MAX_DCACHE_SETS 1024
+#define MAX_DCACHE_WAYS 8
+#define MAX_DCACHE_LINE 256
+#define MAX_DCACHE_MISS 1000
+#define MAX_BP_BITS 14
+
+/* branch predictors: none, backward taken/forward not taken, a table of
+   2-bit counters indexed by pc, and the same indexed by pc ^ history */
+enum { PREDICT_NONE, PREDICT_BTFN, PREDICT_BIMODAL, PREDICT_GSHARE };
+
+/*
+ * The shape of the pipeline: instructions fetched and issued per cycle,
+ * pre-issue queue entries, and for each class of functional unit the number
+ * of units and of pre-ALU queue entries. Each unit takes one entry of its
+ * class per cycle, and issue adds at most one per unit. MEM can sit
+ * behind a data cache of dcache_sets sets (none if 0) of dcache_ways lines
+ * of dcache_line bytes each, on which a miss holds MEM dcache_miss cycles.
+ * With a branch predictor (with 2^bp_bits counters if it has any), fetch
+ * goes on past a waiting branch along the predicted path.
+ */
+struct config {
+  int fetch, issue, pre_issue;
+  int units[3], depth[3];
+  int dcache_sets, dcache_ways, dcache_line, dcache_miss;
+  int predictor, bp_bits;
+};
+
+/* the machine the trace format was made for; see configs[] for the rest */
+static const struct config config_default = { 2, 3, 4, { 1, 1, 1 }, { 2, 1, 1 }, 0, 2, 32, 10, PREDICT_NONE, 10 };
+static const struct config config_wide = { 4, 6, 8, { 2, 2, 2 }, { 4, 2, 2 }, 0, 2, 32, 10, PREDICT_NONE, 10 };
+
+/* an instruction in a pipeline queue, its two operands or its result, and
+   the address it was fetched from (set only outside the default pipeline) */
+struct entry {
+  int32_t ins, a, b, pc;
+};
+
+/*
+ * The pre-issue queue of any pipeline but the default one. Entries take
+ * slots from 0 up in fetch order, so a lower slot always holds an older
+ * entry, and a slot stays empty once its entry issues until the window is
+ * compacted. There are twice as many slots as entries, so compacting is
+ * rare. Sets of slots are bitmaps, kept per register: the entries that
+ * must wait while it is being written (uses), and those that write it and
+ * read it, which hold back younger entries until they issue. An entry is
+ * ready once no register in its uses is in willwrite, so writeback wakes
+ * it, and issue bit-scans the ready ones oldest first.
+ */
+#define WINDOW_SLOTS (2 * MAX_PRE_ISSUE)
+#define WINDOW_WORDS (WINDOW_SLOTS / 64)
+
+struct slots {
+  uint64_t bits[WINDOW_WORDS];
+};
+
+/* a queued instruction with its hazards from window_decode() */
+struct window_item {
+  int32_t ins, pc;
+  int class;
+  uint32_t reads, writes, war;
+};
+
+struct window {
+  int tail, count;
+  struct slots valid, stores;
+  struct slots uses[32], writes[32], reads[32];
+  struct window_item items[WINDOW_SLOTS];
+};
+
+/*
+ * D-cache statistics of the load or store at pc (0 for an unused entry):
+ * its accesses, how many missed, and the cycles it sat in the Pre-MEM queue
+ * while MEM was held by a miss, its own or an older one's. They are kept in
+ * a table hashed on pc.
+ */
+#define DCACHE_PCS 256
+
+struct dcache_pc {
+  int64_t pc, accesses, misses, stalls;
+};
+
+/*
+ * Pipeline statistics. The cycle loop only increments these; print_stats()
+ * formats them once the program breaks. Every field is an int64_t, so
+ * stats_repeat() can walk them as an array.
+ */
+struct stats {
+  /* cycles that issued 0..MAX_ISSUE instructions */
+  int64_t issued[MAX_ISSUE + 1];
+  /* cycles the oldest pre-issue entry was held back, by its first cause */
+  int64_t stalls[NSTALLS];
+  /* cycles the IF unit held a branch waiting on its operands, and cycles
+     fetch stopped at a full pre-issue queue */
+  int64_t branch_wait, fetch_full;
+  /* cycles that ended with 0..MAX_PRE_ISSUE pre-issue entries */
+  int64_t pre_issue[MAX_PRE_ISSUE + 1];
+  /* unit-cycles ALU1, ALU2, ALU3 and MEM units had an instruction */
+  int64_t busy[4];
+  /* D-cache accesses that hit and missed, lines the misses evicted and how
+     many of those were dirty, and cycles MEM was held by a miss */
+  int64_t dcache_hits, dcache_misses, dcache_evictions, dcache_writebacks, dcache_stalls;
+  /* the same per load and store, for the first DCACHE_PCS of them */
+  struct dcache_pc dcache_pcs[DCACHE_PCS];
+  /* branches a predictor resolved and how many it got wrong, cycles the
+     ones it got right waited while fetch went on, and entries fetched past
+     the wrong ones that were squashed */
+  int64_t bp_branches, bp_mispredicts, bp_recovered, bp_squashed;
+};
+
+/*
+ * The complete state of one simulated machine. Nothing else in the
+ * simulator is mutable, so independent machines can run on different
+ * threads at the same time.
+ */
+struct machine {
+  int32_t *mem, mem_data, mem_end;
+  /* bytes at mem, which covers at least [256, mem_end) */
+  size_t mem_size;
+  /* the image or checkpoint mapping mem points into, or NULL if allocated */
+  void *mem_map;
+  size_t mem_mapped;
+  /* memory past mem_size: pages[addr >> TABLE_SHIFT][addr >> PAGE_SHIFT &
+     (TABLE_PAGES - 1)], or NULL if nothing was stored there; the page used
+     last is cached as page_addr (PAGE_NONE if none) and page_mem */
+  int32_t ***pages;
+  uint32_t page_addr;
+  int32_t *page_mem;
+  struct config config;
+  int32_t pc;
+  /* queues hold their instructions oldest first from entry 0 up, and no
+     entry past config's size is ever used; the default pipeline queues
+     for issue in pre_issue, and all others in window */
+  int32_t pre_issue[4];
+  /* per class: the pre-ALU queue (address and store value for ALU1,
+     operands for ALU2 and ALU3) and what its units did last cycle, which
+     for ALU1 is the Pre-MEM queue and for the others Post-ALU2 and
+     Post-ALU3 with the result in a */
+  struct entry pre_alu[3][MAX_DEPTH];
+  struct entry post_alu[3][MAX_UNITS];
+  /* loads MEM completed last cycle, with the value in a */
+  struct entry post_mem[MAX_UNITS];
+  /* the entry the default pipeline issued to each class this cycle */
+  struct entry latch[3];
+  struct window window;
+  /* per D-cache set, the lines it holds, most recently used first: the
+     address of the line, | 2 if dirty, | 1 if valid; and the cycles MEM is
+     still held by the miss of its oldest entry */
+  uint32_t dcache[MAX_DCACHE_SETS * MAX_DCACHE_WAYS];
+  int dcache_wait;
+  int32_t regs[32];
+  int32_t willwrite;
+  /* cycles completed so far, and instructions completed in them (or
+     executed by machine_ff()) */
+  int cycle;
+  int64_t retired;
+  /* IF unit: the branch waiting on its operands and the instruction it
+     executed last cycle (branch, jal or break) */
+  int32_t branch, executed;
+  /* the waiting branch's address and the slot of the first entry fetched
+     past it; under a predictor, whether fetch took the branch and the cycles
+     it has waited, and the predictor's counters and global history */
+  int32_t branch_pc;
+  int spec_slot, spec_taken, spec_wait;
+  uint8_t bp_counters[1 << MAX_BP_BITS];
+  uint32_t bp_history;
+  /* address written by MEM last cycle (0 if none) and its old value */
+  int32_t stored, stored_old;
+  struct stats stats;
+};
 
 __attribute__((format(printf, 1, 2)))
 static void err(const char *format, ...)
@@ -79,441 +320,3632 @@ static void err(const char *format, ...)
   write(2, buf, s - buf);
 }
 
+struct writer;
+struct trace_pipe;
+struct machine;
+
+/*
+ * A job of a batch, which an error ends without ending the batch. fail()
+ * shuts down the trace pipe, closes the writers the job has open, as the
+ * frames holding them are about to go, and unloads its machine, then
+ * resumes the worker at env.
+ */
+struct job {
+  jmp_buf env;
+  struct writer *writers;
+  struct trace_pipe *pipe;
+  /* set by the loaders once the machine holds memory */
+  struct machine *machine;
+};
+
+/* the job this thread is running, if any */
+static _Thread_local struct job *job;
+
+/* exit with status, or within a job, give up only the job */
+static void __attribute__((noreturn)) fail(int status);
+
 #define err_sys_(format, ...) err(format ": %s", __VA_ARGS__)
 #define err_sys(...) err_sys_(__VA_ARGS__, strerror(errno))
 
-static void program_load(const char *filename)
+static void __attribute__((noreturn)) mem_fault(int32_t addr)
 {
-  int fd = open(filename, O_RDONLY);
-  if (fd < 0) {
-    err_sys("could not open '%s'", filename);
-    exit(1);
-  }
+  err("%s memory access at address %d", addr & 3 ? "misaligned" : "out-of-range", addr);
+  fail(1);
+}
 
-  struct stat st;
-  if (fstat(fd, &st)) {
-    err_sys("could not stat '%s'", filename);
-    exit(1);
-  }
+/* word index of addr in the image; misaligned addresses rotate out of range */
+static inline uint32_t mem_index(int32_t addr)
+{
+  uint32_t off = (uint32_t)addr - 256;
+  return off >> 2 | off << 30;
+}
 
-  ssize_t read_size;
-  char buf[1024];
-  unsigned long mem_size = st.st_size >> 5;
-  mem = calloc(mem_size, sizeof(int32_t));
-  int32_t *cur = mem;
-  int32_t *end = mem + mem_size;
-  int nbits = 32;
-  int32_t value = 0;
+/* the page holding addr, or NULL if it was never stored to */
+static inline int32_t *mem_page(const struct machine *m, int32_t addr)
+{
+  if (addr < 256 || addr & 3)
+    mem_fault(addr);
+  int32_t **table = m->pages ? m->pages[addr >> TABLE_SHIFT] : NULL;
+  return table ? table[addr >> PAGE_SHIFT & (TABLE_PAGES - 1)] : NULL;
+}
 
-  while ((read_size = read(fd, buf, sizeof(buf))) > 0) {
-    for (ssize_t i = 0; i < read_size; ++i) {
-      if (buf[i] == '0') {
-        value = value << 1;
-      } else if (buf[i] == '1') {
-        value = value << 1 | 1;
-      } else {
-        continue;
-      }
-      if (--nbits) {
-        continue;
-      }
-      *(cur++) = value;
-      if (value == 127) {
-        mem_data = (char *)cur - (char *)mem + 256;
-      }
-      if (cur == end) {
-        goto done;
-      }
-      nbits = 32;
-      value = 0;
-    }
+/* page 0 also holds the out-of-range addresses below 256, so it is never cached */
+static inline int32_t *mem_cache(struct machine *m, int32_t addr, int32_t *page)
+{
+  if (addr >= PAGE_SIZE) {
+    m->page_addr = addr & ~(PAGE_SIZE - 1);
+    m->page_mem = page;
   }
+  return &page[(addr & (PAGE_SIZE - 1)) >> 2];
+}
+
+static int32_t *mem_page_alloc(struct machine *m, int32_t addr)
+{
+  int32_t ***table, **page;
+  if (!m->pages && !(m->pages = calloc(MEM_LIMIT >> TABLE_SHIFT, sizeof(*m->pages))))
+    goto nomem;
+  table = &m->pages[addr >> TABLE_SHIFT];
+  if (!*table && !(*table = calloc(TABLE_PAGES, sizeof(**table))))
+    goto nomem;
+  page = &(*table)[addr >> PAGE_SHIFT & (TABLE_PAGES - 1)];
+  if (!(*page = calloc(1, PAGE_SIZE)))
+    goto nomem;
+  return *page;
+nomem:
+  err("could not allocate memory");
+  fail(1);
+}
 
-  if (read_size) {
-    err_sys("read");
-    exit(1);
+static void mem_free(struct machine *m)
+{
+  if (!m->pages)
+    return;
+  for (uint32_t t = 0; t < MEM_LIMIT >> TABLE_SHIFT; ++t) {
+    if (!m->pages[t])
+      continue;
+    for (int p = 0; p < TABLE_PAGES; ++p)
+      free(m->pages[t][p]);
+    free(m->pages[t]);
   }
+  free(m->pages);
+  m->pages = NULL;
+}
 
-done:
-  close(fd);
-  mem_end = (char *)cur - (char *)mem + 256;
+static inline int32_t mem_load(struct machine *m, int32_t addr)
+{
+  if (mem_index(addr) < m->mem_size / 4)
+    return mem32(m, addr);
+  if ((addr & PAGE_MASK) == m->page_addr)
+    return m->page_mem[(addr & (PAGE_SIZE - 1)) >> 2];
+  int32_t *page = mem_page(m, addr);
+  return page ? *mem_cache(m, addr, page) : 0;
 }
 
-static int32_t rget(int id)
+/* mem_load without touching the cached page */
+static inline int32_t mem_peek(const struct machine *m, int32_t addr)
 {
-  return regs[id];
+  if (mem_index(addr) < m->mem_size / 4)
+    return mem32(m, addr);
+  int32_t *page = mem_page(m, addr);
+  return page ? page[(addr & (PAGE_SIZE - 1)) >> 2] : 0;
 }
 
-static void rset(int id, int32_t val)
+static void __attribute__((noinline)) mem_store_page(struct machine *m, int32_t addr, int32_t val)
 {
-  if (id) {
-    regs[id] = val;
-    willwrite &= ~(1 << id);
-  }
+  int32_t *page = mem_page(m, addr);
+  if (!page)
+    page = mem_page_alloc(m, addr);
+  *mem_cache(m, addr, page) = val;
 }
 
-static void print_instruction(FILE *out, int32_t ins)
+static inline void mem_store(struct machine *m, int32_t addr, int32_t val)
 {
-  if (!ins) {
-    fputc('\n', out);
-    return;
+  if (mem_index(addr) < m->mem_size / 4)
+    mem32(m, addr) = val;
+  else if ((addr & PAGE_MASK) == m->page_addr)
+    m->page_mem[(addr & (PAGE_SIZE - 1)) >> 2] = val;
+  else
+    mem_store_page(m, addr, val);
+}
+
+#define WRITER_SIZE (1 << 20)
+
+struct verifier;
+static void verify_write(struct verifier *v, const char *data, size_t n);
+static void verify_close(struct verifier *v);
+
+/* buffered output with hand-rolled integer formatting; with verify set,
+   the output is checked against an expected trace instead of written */
+struct writer {
+  int fd;
+  size_t len;
+  char *buf;
+  struct verifier *verify;
+  /* the next writer open in this thread's job */
+  struct writer *next;
+};
+
+static const char digit_pairs[201] =
+  "00010203040506070809" "10111213141516171819"
+  "20212223242526272829" "30313233343536373839"
+  "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879"
+  "80818283848586878889" "90919293949596979899";
+
+/* buffer output to fd, which the caller keeps open */
+static void writer_init(struct writer *w, int fd)
+{
+  w->fd = fd;
+  w->len = 0;
+  w->verify = NULL;
+  w->buf = malloc(WRITER_SIZE);
+  if (!w->buf) {
+    err("could not allocate output buffer");
+    fail(1);
   }
-  fputs(" [", out);
-#define CASE(op, ...) case OP_ ## op: fprintf(out, #op " " __VA_ARGS__); break
-  switch (opcode(ins)) {
-    CASE(beq,   "x%d, x%d, #%d", rs1(ins), rs2(ins), imm1(ins));
-    CASE(bne,   "x%d, x%d, #%d", rs1(ins), rs2(ins), imm1(ins));
-    CASE(blt,   "x%d, x%d, #%d", rs1(ins), rs2(ins), imm1(ins));
-    CASE(sw,    "x%d, %d(x%d)",  rs1(ins), imm1(ins), rs2(ins));
-    CASE(add,   "x%d, x%d, x%d", rd(ins), rs1(ins), rs2(ins));
-    CASE(sub,   "x%d, x%d, x%d", rd(ins), rs1(ins), rs2(ins));
-    CASE(and,   "x%d, x%d, x%d", rd(ins), rs1(ins), rs2(ins));
-    CASE(or,    "x%d, x%d, x%d", rd(ins), rs1(ins), rs2(ins));
-    CASE(addi,  "x%d, x%d, #%d", rd(ins), rs1(ins), imm3(ins));
-    CASE(andi,  "x%d, x%d, #%d", rd(ins), rs1(ins), imm3(ins));
-    CASE(ori,   "x%d, x%d, #%d", rd(ins), rs1(ins), imm3(ins));
-    CASE(sll,   "x%d, x%d, #%d", rd(ins), rs1(ins), imm3(ins));
-    CASE(sra,   "x%d, x%d, #%d", rd(ins), rs1(ins), imm3(ins));
-    CASE(lw,    "x%d, %d(x%d)",  rd(ins), imm3(ins), rs1(ins));
-    CASE(jal,   "x%d, #%d",      rd(ins), imm4(ins));
-    case OP_break: fputs("break", out);
+  w->next = NULL;
+  if (job) {
+    w->next = job->writers;
+    job->writers = w;
   }
-#undef CASE
-  fputs("]\n", out);
 }
 
-static void program_simulate(const char *filename)
+static void writer_open(struct writer *w, const char *filename)
 {
-  FILE *out = fopen(filename, "w");
-  if (!out) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
     err_sys("could not open '%s'", filename);
-    exit(1);
+    fail(1);
   }
+  writer_init(w, fd);
+}
 
-  int cycle_num = 0;
-  int32_t branch = 0;
-  int32_t ins;
-
-cycle:
-  int32_t fetch_executed = 0;
-  int32_t ww = willwrite;
-  int32_t wr = 0;
-  int has_store = 0;
-  int limit = 4;
-
-  /* Issue */
-  for (int i = 0; i < 4 && (ins = pre_issue[i]); ++i) {
-    switch (opcode(ins)) {
-      case OP_sw:
-        if (pre_alu1_ins2 || (ww | wr) & (1 << rs1(ins)) || ww & (1 << rs2(ins)) || has_store) {
-          has_store = 1;
-          wr |= (1 << rs1(ins)) | (1 << rs2(ins));
-          continue;
-        }
-        pre_alu1_ins2 = ins;
-        pre_alu1_addr2 = rget(rs2(ins)) + imm1(ins);
-        pre_alu1_val2 = rget(rs1(ins));
-        break;
-      case OP_add:
-      case OP_sub:
-        if (pre_alu2_ins2 || pre_alu2_ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins)) || ww & (1 << rs2(ins))) {
-          ww |= 1 << rd(ins);
-          wr |= (1 << rs1(ins)) | (1 << rs2(ins));
-          continue;
-        }
-        pre_alu2_ins2 = ins;
-        pre_alu2_lhs2 = rget(rs1(ins));
-        pre_alu2_rhs2 = rget(rs2(ins));
-        willwrite |= 1 << rd(ins);
-        break;
-      case OP_and:
-      case OP_or:
-        if (pre_alu3_ins2 || pre_alu3_ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins)) || ww & (1 << rs2(ins))) {
-          ww |= 1 << rd(ins);
-          wr |= (1 << rs1(ins)) | (1 << rs2(ins));
-          continue;
-        }
-        pre_alu3_ins2 = ins;
-        pre_alu3_lhs2 = rget(rs1(ins));
-        pre_alu3_rhs2 = rget(rs2(ins));
-        willwrite |= 1 << rd(ins);
-        break;
-      case OP_addi:
-        if (pre_alu2_ins2 || pre_alu2_ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins))) {
-          ww |= 1 << rd(ins);
-          wr |= 1 << rs1(ins);
-          continue;
-        }
-        pre_alu2_ins2 = ins;
-        pre_alu2_lhs2 = rget(rs1(ins));
-        pre_alu2_rhs2 = imm3(ins);
-        willwrite |= 1 << rd(ins);
-        break;
-      case OP_andi:
-      case OP_ori:
-      case OP_sll:
-      case OP_sra:
-        if (pre_alu3_ins2 || pre_alu3_ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins))) {
-          ww |= 1 << rd(ins);
-          wr |= 1 << rs1(ins);
-          continue;
-        }
-        pre_alu3_ins2 = ins;
-        pre_alu3_lhs2 = rget(rs1(ins));
-        pre_alu3_rhs2 = imm3(ins);
-        willwrite |= 1 << rd(ins);
-        break;
-      case OP_lw:
-        if (pre_alu1_ins2 || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins)) || has_store) {
-          ww |= 1 << rd(ins);
-          wr |= 1 << rs1(ins);
-          continue;
-        }
-        pre_alu1_ins2 = ins;
-        pre_alu1_addr2 = rget(rs1(ins)) + imm3(ins);
-        willwrite |= 1 << rd(ins);
-        break;
-    }
-    ww |= willwrite;
-    for (int j = i; j < 3; ++j) {
-      pre_issue[j] = pre_issue[j + 1];
-    }
-    pre_issue[3] = 0;
-    --i;
-    --limit;
+static void writer_flush(struct writer *w)
+{
+  if (w->verify) {
+    verify_write(w->verify, w->buf, w->len);
+    w->len = 0;
+    return;
   }
-
-  /* Fetch/Decode */
-  if (branch) {
-    goto stop_fetch;
+  for (size_t off = 0; off < w->len; ) {
+    ssize_t n = write(w->fd, w->buf + off, w->len - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      err_sys("write");
+      fail(1);
+    }
+    off += n;
   }
+  w->len = 0;
+}
 
-  for (int i = 0; i < 2; ++i) {
-    int slot = 0;
-    while (pre_issue[slot]) {
-      if (++slot == limit) {
-        goto stop_fetch;
-      }
-    }
-    int32_t ins = mem32(pc);
-    pc += 4;
-    switch (opcode(ins)) {
-      case OP_beq:
-      case OP_bne:
-      case OP_blt:
-        branch = ins;
-        goto stop_fetch;
-      case OP_sw:
-      case OP_add:
-      case OP_sub:
-      case OP_and:
-      case OP_or:
-      case OP_addi:
-      case OP_andi:
-      case OP_ori:
-      case OP_sll:
-      case OP_sra:
-      case OP_lw:
-        pre_issue[slot] = ins;
-        break;
-      case OP_jal:
-        rset(rd(ins), pc);
-        pc = pc - 4 + (imm4(ins) << 1);
-        fetch_executed = ins;
-        goto stop_fetch;
-      case OP_break:
-        fetch_executed = ins;
-        goto stop_fetch;
-      default:
-        err("invalid opcode %d", opcode(ins));
-        exit(155);
+static void writer_close(struct writer *w)
+{
+  writer_flush(w);
+  for (struct writer **p = job ? &job->writers : NULL; p && *p; p = &(*p)->next) {
+    if (*p == w) {
+      *p = w->next;
+      break;
     }
   }
-stop_fetch:
+  if (w->verify) {
+    verify_close(w->verify);
+    free(w->verify);
+  } else if (close(w->fd)) {
+    err_sys("close");
+    fail(1);
+  }
+  free(w->buf);
+}
 
-  if (branch && !(ww & (1 << rs1(branch)) || ww & (1 << rs2(branch)))) {
-    switch (opcode(branch)) {
-      case OP_beq:
-        if (rget(rs1(branch)) == rget(rs2(branch)))
-          pc = pc - 4 + (imm1(branch) << 1);
-        break;
-      case OP_bne:
-        if (rget(rs1(branch)) != rget(rs2(branch)))
-          pc = pc - 4 + (imm1(branch) << 1);
-        break;
-      case OP_blt:
-        if (rget(rs1(branch)) < rget(rs2(branch)))
-          pc = pc - 4 + (imm1(branch) << 1);
-        break;
-    }
-    fetch_executed = branch;
-    branch = 0;
+/* make room for n <= WRITER_SIZE bytes */
+static inline char *writer_reserve(struct writer *w, size_t n)
+{
+  if (w->len + n > WRITER_SIZE)
+    writer_flush(w);
+  return w->buf + w->len;
+}
+
+static void writer_write_slow(struct writer *w, const char *data, size_t n)
+{
+  while (n) {
+    if (w->len == WRITER_SIZE)
+      writer_flush(w);
+    size_t k = WRITER_SIZE - w->len < n ? WRITER_SIZE - w->len : n;
+    memcpy(w->buf + w->len, data, k);
+    w->len += k;
+    data += k;
+    n -= k;
   }
+}
 
-  /* WB */
-  if (post_mem_ins) {
-    rset(rd(post_mem_ins), post_mem_val);
-    post_mem_ins = 0;
+static inline void writer_write(struct writer *w, const void *data, size_t n)
+{
+  if (n > WRITER_SIZE - w->len) {
+    writer_write_slow(w, data, n);
+    return;
   }
-  if (post_alu2_ins) {
-    rset(rd(post_alu2_ins), post_alu2_val);
-    post_alu2_ins = 0;
+  memcpy(w->buf + w->len, data, n);
+  w->len += n;
+}
+
+#define writer_puts(w, s) writer_write(w, s, sizeof(s) - 1)
+
+static inline void writer_putc(struct writer *w, char c)
+{
+  *writer_reserve(w, 1) = c;
+  ++w->len;
+}
+
+static inline void writer_int(struct writer *w, int32_t value)
+{
+  char tmp[11];
+  char *p = tmp + sizeof(tmp);
+  uint32_t u = value < 0 ? -(uint32_t)value : value;
+  while (u >= 100) {
+    p -= 2;
+    memcpy(p, digit_pairs + u % 100 * 2, 2);
+    u /= 100;
   }
-  if (post_alu3_ins) {
-    rset(rd(post_alu3_ins), post_alu3_val);
-    post_alu3_ins = 0;
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, digit_pairs + u * 2, 2);
+  } else {
+    *--p = '0' + u;
   }
+  if (value < 0)
+    *--p = '-';
+  writer_write(w, p, tmp + sizeof(tmp) - p);
+}
 
-  /* MEM */
-  if (pre_mem_ins) {
-    switch (opcode(pre_mem_ins)) {
-      case OP_lw:
-        post_mem_ins = pre_mem_ins;
-        post_mem_val = mem32(pre_mem_addr);
-        break;
-      case OP_sw:
-        mem32(pre_mem_addr) = pre_mem_val;
-        break;
-    }
-    pre_mem_ins = 0;
+static void *map_file(const char *filename, struct stat *st)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    err_sys("could not open '%s'", filename);
+    fail(1);
   }
-
-  /* ALU3 */
-  if (pre_alu3_ins) {
-    switch (opcode(pre_alu3_ins)) {
-      case OP_and:
-      case OP_andi:
-        post_alu3_val = pre_alu3_lhs & pre_alu3_rhs;
-        break;
-      case OP_or:
-      case OP_ori:
-        post_alu3_val = pre_alu3_lhs | pre_alu3_rhs;
-        break;
-      case OP_sll:
-        post_alu3_val = pre_alu3_lhs << pre_alu3_rhs;
-        break;
-      case OP_sra:
-        post_alu3_val = pre_alu3_lhs >> pre_alu3_rhs;
-        break;
-    }
-    post_alu3_ins = pre_alu3_ins;
+  if (fstat(fd, st)) {
+    err_sys("could not stat '%s'", filename);
+    close(fd);
+    fail(1);
   }
-
-  /* ALU2 */
-  if (pre_alu2_ins) {
-    switch (opcode(pre_alu2_ins)) {
-      case OP_add:
-      case OP_addi:
-        post_alu2_val = pre_alu2_lhs + pre_alu2_rhs;
-        break;
-      case OP_sub:
-        post_alu2_val = pre_alu2_lhs - pre_alu2_rhs;
-        break;
+  void *data = "";
+  if (st->st_size) {
+    data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      err_sys("could not map '%s'", filename);
+      close(fd);
+      fail(1);
     }
-    post_alu2_ins = pre_alu2_ins;
   }
+  close(fd);
+  return data;
+}
 
-  /* ALU1 */
-  if (pre_alu1_ins) {
-    pre_mem_ins = pre_alu1_ins;
-    pre_mem_addr = pre_alu1_addr;
-    pre_mem_val = pre_alu1_val;
-  }
+#define SEPARATOR "--------------------"
+#define SEPARATOR_LEN (sizeof(SEPARATOR) - 1)
 
-  /* Issue */
-  pre_alu1_ins = pre_alu1_ins2;
-  pre_alu1_addr = pre_alu1_addr2;
-  pre_alu1_val = pre_alu1_val2;
-  pre_alu1_ins2 = 0;
+/*
+ * -v: a writer compares its output with an expected trace instead of
+ * writing it. After the first difference, output is collected until the
+ * cycle block holding it is complete, and both versions of that block are
+ * reported.
+ */
+struct verifier {
+  const char *name;
+  const char *expect;
+  size_t size;
+  size_t matched;   /* length of the output that matched so far */
+  int diverged;
+  int lines;        /* no separator before the difference: report one line */
+  size_t block;     /* once diverged, actual holds the output from here on */
+  char *actual;
+  size_t actual_len, actual_cap;
+};
 
-  pre_alu2_ins = pre_alu2_ins2;
-  pre_alu2_lhs = pre_alu2_lhs2;
-  pre_alu2_rhs = pre_alu2_rhs2;
-  pre_alu2_ins2 = 0;
+static int is_separator(const char *data, size_t size, size_t line)
+{
+  return size - line >= SEPARATOR_LEN && !memcmp(data + line, SEPARATOR, SEPARATOR_LEN);
+}
 
-  pre_alu3_ins = pre_alu3_ins2;
-  pre_alu3_lhs = pre_alu3_lhs2;
-  pre_alu3_rhs = pre_alu3_rhs2;
-  pre_alu3_ins2 = 0;
+/* start of the block holding pos: the last separator line at or before it */
+static size_t block_start(const char *data, size_t size, size_t pos)
+{
+  size_t line = pos;
+  while (line && data[line - 1] != '\n')
+    --line;
+  for (size_t start = line; !is_separator(data, size, line); ) {
+    if (!line)
+      return start;
+    do
+      --line;
+    while (line && data[line - 1] != '\n');
+  }
+  return line;
+}
 
-  /* Print */
-  ++cycle_num;
+/* end of the block from block holding pos: the next separator line, or the
+   end of pos's line with lines set; -1 if data ends first */
+static size_t block_end(const char *data, size_t size, size_t block, size_t pos, int lines)
+{
+  if (lines) {
+    const char *end = memchr(data + pos, '\n', size - pos);
+    return end ? (size_t)(end - data) + 1 : (size_t)-1;
+  }
+  size_t line = pos;
+  while (line > block && data[line - 1] != '\n')
+    --line;
+  while (line <= block || !is_separator(data, size, line)) {
+    const char *end = size - line < SEPARATOR_LEN ? NULL : memchr(data + line, '\n', size - line);
+    if (!end)
+      return -1;
+    line = end - data + 1;
+  }
+  return line;
+}
 
-  fprintf(out,
-    "--------------------\n"
-    "Cycle %d:\n"
-    "\n"
-    "IF Unit:\n"
-    ,
-    cycle_num
-  );
+/* cycle number of a block that opens with a separator, or -1 */
+static long block_cycle(const char *data, size_t len)
+{
+  static const char cycle[] = SEPARATOR "\nCycle ";
+  long value = 0;
+  if (len < sizeof(cycle) - 1 || memcmp(data, cycle, sizeof(cycle) - 1))
+    return -1;
+  for (size_t i = sizeof(cycle) - 1; i < len && data[i] >= '0' && data[i] <= '9'; ++i)
+    value = value * 10 + (data[i] - '0');
+  return value;
+}
 
-  fprintf(out, "\tWaiting:");
-  print_instruction(out, branch);
-  fprintf(out, "\tExecuted:");
-  print_instruction(out, fetch_executed);
-  fprintf(out, "Pre-Issue Queue:\n"
-               "\tEntry 0:");
-  print_instruction(out, pre_issue[0]);
-  fprintf(out, "\tEntry 1:");
-  print_instruction(out, pre_issue[1]);
-  fprintf(out, "\tEntry 2:");
-  print_instruction(out, pre_issue[2]);
-  fprintf(out, "\tEntry 3:");
-  print_instruction(out, pre_issue[3]);
-  fprintf(out, "Pre-ALU1 Queue:\n"
-               "\tEntry 0:");
-  print_instruction(out, pre_alu1_ins);
-  fprintf(out, "\tEntry 1:\n"
-               "Pre-MEM Queue:");
-  print_instruction(out, pre_mem_ins);
-  fprintf(out, "Post-MEM Queue:");
-  print_instruction(out, post_mem_ins);
-  fprintf(out, "Pre-ALU2 Queue:");
-  print_instruction(out, pre_alu2_ins);
-  fprintf(out, "Post-ALU2 Queue:");
-  print_instruction(out, post_alu2_ins);
-  fprintf(out, "Pre-ALU3 Queue:");
-  print_instruction(out, pre_alu3_ins);
-  fprintf(out, "Post-ALU3 Queue:");
-  print_instruction(out, post_alu3_ins);
-  fprintf(out,
-    "\n"
-    "Registers\n"
-    "x00:\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n"
-    "x08:\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n"
-    "x16:\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n"
-    "x24:\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n"
-    "Data"
-    ,
-    regs[0],  regs[1],  regs[2],  regs[3],  regs[4],  regs[5],  regs[6],  regs[7],
-    regs[8],  regs[9],  regs[10], regs[11], regs[12], regs[13], regs[14], regs[15],
-    regs[16], regs[17], regs[18], regs[19], regs[20], regs[21], regs[22], regs[23],
-    regs[24], regs[25], regs[26], regs[27], regs[28], regs[29], regs[30], regs[31]
-  );
-  for (int32_t addr = mem_data; addr < mem_end; addr += 4) {
-    if (!((addr - mem_data) & 31)) {
-      fprintf(out, "\n%d:", addr);
+static void verify_append(struct verifier *v, const char *data, size_t n)
+{
+  if (v->actual_len + n > v->actual_cap) {
+    size_t cap = v->actual_cap ? v->actual_cap : 4096;
+    while (cap < v->actual_len + n)
+      cap *= 2;
+    v->actual = realloc(v->actual, cap);
+    v->actual_cap = cap;
+    if (!v->actual) {
+      err("could not allocate verify buffer");
+      fail(1);
     }
-    fprintf(out, "\t%d", mem32(addr));
   }
-  fputc('\n', out);
-
-  if (opcode(fetch_executed) != OP_break) {
-    goto cycle;
-  }
-
-  fclose(out);
+  memcpy(v->actual + v->actual_len, data, n);
+  v->actual_len += n;
 }
 
-int main(int argc, char **argv)
+/* start collecting the block around the first difference at v->matched */
+static void verify_diverge(struct verifier *v)
 {
-  if (argc != 2) {
+  v->diverged = 1;
+  v->block = block_start(v->expect, v->size, v->matched);
+  v->lines = !is_separator(v->expect, v->size, v->block);
+  verify_append(v, v->expect + v->block, v->matched - v->block);
+}
+
+static void verify_fail(struct verifier *v, size_t actual_end)
+{
+  size_t expect_end = block_end(v->expect, v->size, v->block, v->matched, v->lines);
+  if (expect_end == (size_t)-1)
+    expect_end = v->size;
+  size_t expect_len = expect_end - v->block;
+  size_t line = 1;
+  for (const char *p = v->expect; (p = memchr(p, '\n', v->expect + v->matched - p)); ++p)
+    ++line;
+  long cycle = block_cycle(v->expect + v->block, expect_len);
+  if (cycle < 0)
+    cycle = block_cycle(v->actual, actual_end);
+  if (cycle >= 0)
+    err("output differs from '%s' at cycle %ld (line %zu)", v->name, cycle, line);
+  else
+    err("output differs from '%s' at line %zu", v->name, line);
+
+  struct writer out;
+  writer_init(&out, 2);
+  writer_puts(&out, "expected:\n");
+  writer_write(&out, v->expect + v->block, expect_len);
+  if (!expect_len)
+    writer_puts(&out, "(end of file)\n");
+  writer_puts(&out, "actual:\n");
+  writer_write(&out, v->actual, actual_end);
+  if (!actual_end)
+    writer_puts(&out, "(end of output)\n");
+  writer_flush(&out);
+  fail(1);
+}
+
+static void verify_write(struct verifier *v, const char *data, size_t n)
+{
+  if (!v->diverged) {
+    const char *expect = v->expect + v->matched;
+    size_t len = v->size - v->matched < n ? v->size - v->matched : n;
+    if (len == n && !memcmp(data, expect, n)) {
+      v->matched += n;
+      return;
+    }
+    size_t i = 0;
+    while (i < len && data[i] == expect[i])
+      ++i;
+    v->matched += i;
+    verify_diverge(v);
+    data += i;
+    n -= i;
+  }
+  verify_append(v, data, n);
+  size_t end = block_end(v->actual, v->actual_len, 0, v->matched - v->block, v->lines);
+  if (end != (size_t)-1)
+    verify_fail(v, end);
+}
+
+/* output that ends early or late differs too */
+static void verify_close(struct verifier *v)
+{
+  if (!v->diverged && v->matched < v->size)
+    verify_diverge(v);
+  if (v->diverged) {
+    size_t end = block_end(v->actual, v->actual_len, 0, v->matched - v->block, v->lines);
+    verify_fail(v, end == (size_t)-1 ? v->actual_len : end);
+  }
+  if (v->size)
+    munmap((void *)v->expect, v->size);
+}
+
+/* compare the output with the file expected instead of writing it */
+static void writer_open_verify(struct writer *w, const char *expected)
+{
+  struct stat st;
+  writer_init(w, -1);
+  w->verify = calloc(1, sizeof(*w->verify));
+  if (!w->verify) {
+    err("could not allocate verify state");
+    fail(1);
+  }
+  w->verify->name = expected;
+  w->verify->expect = map_file(expected, &st);
+  w->verify->size = st.st_size;
+}
+
+/* write filename, or verify against expected if set */
+static void writer_open_or_verify(struct writer *w, const char *filename, const char *expected)
+{
+  if (expected)
+    writer_open_verify(w, expected);
+  else
+    writer_open(w, filename);
+}
+
+/* reverse the bit order of x */
+static inline uint32_t reverse32(uint32_t x)
+{
+  x = (x >> 1 & 0x55555555) | (x & 0x55555555) << 1;
+  x = (x >> 2 & 0x33333333) | (x & 0x33333333) << 2;
+  x = (x >> 4 & 0x0f0f0f0f) | (x & 0x0f0f0f0f) << 4;
+  return __builtin_bswap32(x);
+}
+
+/*
+ * Pack the 32 characters at s into a word, first character in the most
+ * significant bit. Fails if any of them is not '0' or '1'; those differ only
+ * in the low bit, so (c | 1) == '1' checks for either.
+ */
+static inline int pack_bits32(const char *s, int32_t *word)
+{
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *)s);
+  __m256i ok = _mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(1)), _mm256_set1_epi8('1'));
+  if ((uint32_t)_mm256_movemask_epi8(ok) != 0xffffffff)
+    return 0;
+  /* reverse the bytes so that movemask puts the first character in bit 31 */
+  v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+  v = _mm256_permute4x64_epi64(v, 0x4e);
+  *word = _mm256_movemask_epi8(_mm256_slli_epi16(v, 7));
+  return 1;
+#elif defined(__SSE2__)
+  __m128i lo = _mm_loadu_si128((const __m128i *)s);
+  __m128i hi = _mm_loadu_si128((const __m128i *)(s + 16));
+  __m128i ok = _mm_and_si128(
+    _mm_cmpeq_epi8(_mm_or_si128(lo, _mm_set1_epi8(1)), _mm_set1_epi8('1')),
+    _mm_cmpeq_epi8(_mm_or_si128(hi, _mm_set1_epi8(1)), _mm_set1_epi8('1')));
+  if (_mm_movemask_epi8(ok) != 0xffff)
+    return 0;
+  *word = reverse32(_mm_movemask_epi8(_mm_slli_epi16(lo, 7))
+                    | (uint32_t)_mm_movemask_epi8(_mm_slli_epi16(hi, 7)) << 16);
+  return 1;
+#else
+  int32_t w = 0;
+  for (int i = 0; i < 32; ++i) {
+    if ((s[i] | 1) != '1')
+      return 0;
+    w = w << 1 | (s[i] & 1);
+  }
+  *word = w;
+  return 1;
+#endif
+}
+
+#define IMAGE_MAGIC "VSIM2IMG"
+#define IMAGE_BYTE_ORDER 0x01020304
+
+/*
+ * Cached program image: this header, then the loaded memory (source_size >> 5
+ * words) in host byte order. The image is current if the source size and
+ * mtime match, or failing the mtime, if the source still hashes the same.
+ */
+struct image_header {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t header_size;
+  int32_t mem_data, mem_end;
+  uint64_t source_size;
+  int64_t source_mtime_sec, source_mtime_nsec;
+  uint64_t source_hash;
+  uint64_t reserved;
+};
+
+static uint64_t hash_bytes(const char *data, size_t size)
+{
+  uint64_t h = 0xcbf29ce484222325, w;
+  for (; size >= 8; data += 8, size -= 8) {
+    memcpy(&w, data, 8);
+    h = ((h << 5 | h >> 59) ^ w) * 0x100000001b3;
+  }
+  for (; size; ++data, --size)
+    h = ((h << 5 | h >> 59) ^ (unsigned char)*data) * 0x100000001b3;
+  return h;
+}
+
+/* map a current image of the source (text, st) into m; 0 if there is none */
+static int image_load(struct machine *m, const char *image, const struct stat *st, const char *text)
+{
+  struct image_header hdr;
+  struct stat ist;
+  size_t mem_bytes = (st->st_size >> 5) * sizeof(int32_t);
+  int fd = open(image, O_RDWR);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &ist) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+      || memcmp(hdr.magic, IMAGE_MAGIC, 8) || hdr.byte_order != IMAGE_BYTE_ORDER
+      || hdr.header_size != sizeof(hdr) || hdr.source_size != (uint64_t)st->st_size
+      || (uint64_t)ist.st_size != sizeof(hdr) + mem_bytes
+      || hdr.mem_data < 256 || hdr.mem_end < hdr.mem_data
+      || (size_t)(hdr.mem_end - 256) > mem_bytes)
+    goto stale;
+  if (hdr.source_mtime_sec != st->st_mtim.tv_sec || hdr.source_mtime_nsec != st->st_mtim.tv_nsec) {
+    if (hash_bytes(text, st->st_size) != hdr.source_hash)
+      goto stale;
+    /* touched but unchanged */
+    hdr.source_mtime_sec = st->st_mtim.tv_sec;
+    hdr.source_mtime_nsec = st->st_mtim.tv_nsec;
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+      goto stale;
+  }
+  char *base = mmap(NULL, ist.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED)
+    goto stale;
+  close(fd);
+  m->mem = (int32_t *)(base + sizeof(hdr));
+  m->mem_size = mem_bytes;
+  m->mem_map = base;
+  m->mem_mapped = ist.st_size;
+  m->mem_data = hdr.mem_data;
+  m->mem_end = hdr.mem_end;
+  return 1;
+
+stale:
+  close(fd);
+  return 0;
+}
+
+/* write the loaded program to image; failure only costs the next run a parse */
+static void image_save(const struct machine *m, const char *image, const struct stat *st, const char *text)
+{
+  struct image_header hdr = {
+    .magic = IMAGE_MAGIC,
+    .byte_order = IMAGE_BYTE_ORDER,
+    .header_size = sizeof(hdr),
+    .mem_data = m->mem_data,
+    .mem_end = m->mem_end,
+    .source_size = st->st_size,
+    .source_mtime_sec = st->st_mtim.tv_sec,
+    .source_mtime_nsec = st->st_mtim.tv_nsec,
+    .source_hash = hash_bytes(text, st->st_size),
+  };
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%lx.tmp", image, (long)getpid(), (unsigned long)pthread_self());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    err_sys("could not create '%s'", tmp);
+    return;
+  }
+  /* write() may be short for large images */
+  const char *parts[2] = { (const char *)&hdr, (const char *)m->mem };
+  size_t sizes[2] = { sizeof(hdr), (st->st_size >> 5) * sizeof(int32_t) };
+  for (int i = 0; i < 2; ++i) {
+    for (size_t off = 0; off < sizes[i]; ) {
+      ssize_t n = write(fd, parts[i] + off, sizes[i] - off);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        err_sys("could not write '%s'", tmp);
+        close(fd);
+        unlink(tmp);
+        return;
+      }
+      off += n;
+    }
+  }
+  if (close(fd) || rename(tmp, image)) {
+    err_sys("could not write '%s'", image);
+    unlink(tmp);
+  }
+}
+
+/* load filename into m, which starts over in the reset state of a cfg pipeline */
+static void program_load(struct machine *m, const char *filename, const char *image,
+                         const struct config *cfg)
+{
+  struct stat st;
+  const char *text = map_file(filename, &st);
+  size_t size = st.st_size;
+  const char *p = text;
+  const char *end = p + size;
+
+  memset(m, 0, sizeof(*m));
+  m->config = *cfg;
+  m->pc = 256;
+  m->page_addr = PAGE_NONE;
+  if (job)
+    job->machine = m;
+  if ((size >> 5) * sizeof(int32_t) > MEM_LIMIT - 256) {
+    err("'%s' is too large", filename);
+    if (size)
+      munmap((void *)text, size);
+    fail(1);
+  }
+
+  if (image && image_load(m, image, &st, text)) {
+    if (size)
+      munmap((void *)text, size);
+    return;
+  }
+
+  m->mem_size = (size >> 5) * sizeof(int32_t);
+  m->mem = calloc(1, m->mem_size);
+  if (!m->mem) {
+    err("could not allocate memory");
+    if (size)
+      munmap((void *)text, size);
+    fail(1);
+  }
+  int32_t *cur = m->mem;
+  int nbits = 32;
+  int32_t value = 0;
+
+  if (size)
+    madvise((void *)p, size, MADV_SEQUENTIAL);
+
+  /* any character other than '0' or '1' is skipped, so words may span lines */
+  while (p < end) {
+    if (nbits == 32 && (*p | 1) == '1' && end - p >= 32 && pack_bits32(p, &value)) {
+      p += 32;
+    } else {
+      char c = *p++;
+      if (c == '0') {
+        value = value << 1;
+      } else if (c == '1') {
+        value = value << 1 | 1;
+      } else {
+        continue;
+      }
+      if (--nbits) {
+        continue;
+      }
+      nbits = 32;
+    }
+    *(cur++) = value;
+    if (value == 127) {
+      m->mem_data = (char *)cur - (char *)m->mem + 256;
+    }
+    value = 0;
+  }
+  m->mem_end = (char *)cur - (char *)m->mem + 256;
+
+  if (image)
+    image_save(m, image, &st, text);
+  if (size)
+    munmap((void *)text, size);
+}
+
+static void program_unload(struct machine *m)
+{
+  if (m->mem_map)
+    munmap(m->mem_map, m->mem_mapped);
+  else
+    free(m->mem);
+  m->mem = NULL;
+  mem_free(m);
+}
+
+/* a file holding the memory of loaded program m, for program_clone() */
+static int program_share(const struct machine *m)
+{
+  int fd = memfd_create("Vsim", MFD_CLOEXEC);
+  if (fd < 0) {
+    err_sys("could not create shared memory");
+    fail(1);
+  }
+  for (size_t off = 0; off < m->mem_size; ) {
+    ssize_t n = pwrite(fd, (const char *)m->mem + off, m->mem_size - off, off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      err_sys("could not write shared memory");
+      fail(1);
+    }
+    off += n;
+  }
+  return fd;
+}
+
+/*
+ * Start m over as a cfg pipeline running the program in proto, whose memory
+ * was shared as fd. m maps that memory privately, so the pages m never
+ * stores to stay shared with every other clone.
+ */
+static void program_clone(struct machine *m, const struct machine *proto, int fd,
+                          const struct config *cfg)
+{
+  *m = *proto;
+  m->config = *cfg;
+  m->mem = NULL;
+  m->mem_map = NULL;
+  m->mem_mapped = 0;
+  if (job)
+    job->machine = m;
+  if (!m->mem_size)
+    return;
+  void *mem = mmap(NULL, m->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (mem == MAP_FAILED) {
+    err_sys("could not map shared memory");
+    fail(1);
+  }
+  m->mem = m->mem_map = mem;
+  m->mem_mapped = m->mem_size;
+}
+
+/* named configurations for -m */
+static const struct {
+  const char *name;
+  const struct config *config;
+} configs[] = {
+  { "default", &config_default },
+  { "wide", &config_wide },
+};
+
+/* the configuration fields -m can set, each of which ranges from min to max */
+static const struct {
+  const char *name;
+  size_t offset;
+  int min, max;
+} config_fields[] = {
+  { "fetch", offsetof(struct config, fetch), 1, MAX_FETCH },
+  { "issue", offsetof(struct config, issue), 1, MAX_ISSUE },
+  { "pre-issue", offsetof(struct config, pre_issue), 1, MAX_PRE_ISSUE },
+  { "alu1", offsetof(struct config, units[ALU1]), 1, MAX_UNITS },
+  { "alu2", offsetof(struct config, units[ALU2]), 1, MAX_UNITS },
+  { "alu3", offsetof(struct config, units[ALU3]), 1, MAX_UNITS },
+  { "alu1-queue", offsetof(struct config, depth[ALU1]), 1, MAX_DEPTH },
+  { "alu2-queue", offsetof(struct config, depth[ALU2]), 1, MAX_DEPTH },
+  { "alu3-queue", offsetof(struct config, depth[ALU3]), 1, MAX_DEPTH },
+  { "dcache-sets", offsetof(struct config, dcache_sets), 0, MAX_DCACHE_SETS },
+  { "dcache-ways", offsetof(struct config, dcache_ways), 1, MAX_DCACHE_WAYS },
+  { "dcache-line", offsetof(struct config, dcache_line), 4, MAX_DCACHE_LINE },
+  { "dcache-miss", offsetof(struct config, dcache_miss), 1, MAX_DCACHE_MISS },
+  { "predictor", offsetof(struct config, predictor), PREDICT_NONE, PREDICT_GSHARE },
+  { "bp-bits", offsetof(struct config, bp_bits), 1, MAX_BP_BITS },
+};
+
+#define config_field(c, i) (*(int *)((char *)(c) + config_fields[i].offset))
+
+static int config_check(struct config *c)
+{
+  for (size_t i = 0; i < sizeof(config_fields) / sizeof(*config_fields); ++i) {
+    if (config_field(c, i) < config_fields[i].min || config_field(c, i) > config_fields[i].max)
+      return -1;
+  }
+  /* sets and lines are indexed by address bits */
+  if (c->dcache_sets & (c->dcache_sets - 1) || c->dcache_line & (c->dcache_line - 1))
+    return -1;
+  return 0;
+}
+
+static int config_equal(const struct config *a, const struct config *b)
+{
+  return !memcmp(a, b, sizeof(*a));
+}
+
+/*
+ * Apply a -m list of comma-separated items to c. An item is the name of one
+ * of configs[], which replaces all of c, or field=value.
+ */
+static int config_parse(struct config *c, const char *spec)
+{
+  for (const char *p = spec, *end; *p; p = end + (*end == ',')) {
+    end = strchr(p, ',');
+    if (!end)
+      end = p + strlen(p);
+    const char *eq = memchr(p, '=', end - p);
+    size_t len = (eq ? eq : end) - p;
+    size_t i, n;
+    if (!eq) {
+      n = sizeof(configs) / sizeof(*configs);
+      for (i = 0; i < n && (strlen(configs[i].name) != len || memcmp(configs[i].name, p, len)); ++i)
+        ;
+      if (i == n)
+        return -1;
+      *c = *configs[i].config;
+      continue;
+    }
+    n = sizeof(config_fields) / sizeof(*config_fields);
+    for (i = 0; i < n && (strlen(config_fields[i].name) != len || memcmp(config_fields[i].name, p, len)); ++i)
+      ;
+    char *q;
+    long value = strtol(eq + 1, &q, 10);
+    if (i == n || q == eq + 1 || q != end || value < config_fields[i].min || value > config_fields[i].max)
+      return -1;
+    config_field(c, i) = value;
+  }
+  return config_check(c);
+}
+
+#define CHECKPOINT_MAGIC "VSIMCKP2"
+
+/*
+ * A checkpoint is this header, struct machine as it is in memory (pointers
+ * included, they are fixed up on restore), the mem_size bytes of memory, and
+ * then each allocated page as its address (a uint32_t) and PAGE_SIZE bytes.
+ * It is only meaningful to the build that wrote it, which machine_size and
+ * byte_order guard against.
+ */
+struct checkpoint_header {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t header_size;
+  uint32_t machine_size;
+  uint32_t pages;
+  uint64_t mem_size;
+};
+
+/* cycles to checkpoint at: each listed one and every interval'th */
+struct schedule {
+  int *cycles;
+  size_t count;
+  int interval;
+};
+
+/* first scheduled cycle after cycle, or 0 if there is none */
+static int next_checkpoint(const struct schedule *save, int cycle)
+{
+  int next = 0;
+  if (save->interval)
+    next = (cycle / save->interval + 1) * save->interval;
+  for (size_t i = 0; i < save->count; ++i) {
+    if (save->cycles[i] > cycle && (!next || save->cycles[i] < next))
+      next = save->cycles[i];
+  }
+  return next;
+}
+
+/* checkpoints are named <base>.<cycle>.ckpt; base is the input program */
+static void checkpoint_base(char *base, size_t size, const char *filename)
+{
+  size_t len = strlen(filename);
+  if (len > 5 && !strcmp(filename + len - 5, ".ckpt")) {
+    size_t n = len - 5;
+    while (n && filename[n - 1] >= '0' && filename[n - 1] <= '9')
+      --n;
+    if (n < len - 5 && n && filename[n - 1] == '.')
+      len = n - 1;
+  }
+  snprintf(base, size, "%.*s", (int)len, filename);
+}
+
+/* visit each allocated page of m and its address, in address order */
+#define for_each_page(m, addr, page)                                             \
+  for (uint32_t t_ = 0; (m)->pages && t_ < MEM_LIMIT >> TABLE_SHIFT; ++t_)      \
+    for (uint32_t p_ = 0; (m)->pages[t_] && p_ < TABLE_PAGES; ++p_)              \
+      if (((page) = (m)->pages[t_][p_]) && ((addr) = t_ << TABLE_SHIFT | p_ << PAGE_SHIFT, 1))
+
+static void checkpoint_save(const struct machine *m, const char *filename)
+{
+  struct checkpoint_header hdr = {
+    .magic = CHECKPOINT_MAGIC,
+    .byte_order = IMAGE_BYTE_ORDER,
+    .header_size = sizeof(hdr),
+    .machine_size = sizeof(*m),
+    .mem_size = m->mem_size,
+  };
+  uint32_t addr;
+  int32_t *page;
+  for_each_page(m, addr, page)
+    ++hdr.pages;
+  struct writer out;
+  writer_open(&out, filename);
+  writer_write(&out, &hdr, sizeof(hdr));
+  writer_write(&out, m, sizeof(*m));
+  writer_write(&out, m->mem, m->mem_size);
+  for_each_page(m, addr, page) {
+    writer_write(&out, &addr, sizeof(addr));
+    writer_write(&out, page, PAGE_SIZE);
+  }
+  writer_close(&out);
+}
+
+/* restore m from a checkpoint; memory is mapped copy-on-write rather than read */
+static void checkpoint_load(struct machine *m, const char *filename)
+{
+  struct checkpoint_header hdr;
+  struct stat st;
+  size_t off = sizeof(hdr) + sizeof(*m);
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    err_sys("could not open '%s'", filename);
+    fail(1);
+  }
+  if (fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+      || memcmp(hdr.magic, CHECKPOINT_MAGIC, 8) || hdr.byte_order != IMAGE_BYTE_ORDER
+      || hdr.header_size != sizeof(hdr) || hdr.machine_size != sizeof(*m)
+      || (uint64_t)st.st_size != off + hdr.mem_size + hdr.pages * (uint64_t)(4 + PAGE_SIZE)
+      || pread(fd, m, sizeof(*m), sizeof(hdr)) != sizeof(*m) || config_check(&m->config)
+      || m->mem_size != hdr.mem_size || m->mem_data < 256 || m->mem_end < m->mem_data
+      || (size_t)(m->mem_end - 256) > m->mem_size) {
+    err("'%s' is not a checkpoint from this build", filename);
+    close(fd);
+    fail(1);
+  }
+  char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    err_sys("could not map '%s'", filename);
+    close(fd);
+    fail(1);
+  }
+  close(fd);
+  m->mem = (int32_t *)(base + off);
+  m->mem_map = base;
+  m->mem_mapped = st.st_size;
+  m->pages = NULL;
+  m->page_addr = PAGE_NONE;
+  m->page_mem = NULL;
+  /* until here m held whatever the file did, which is nothing to unload */
+  if (job)
+    job->machine = m;
+  /* pages are few and small next to mem, so they are copied out */
+  const char *p = base + off + hdr.mem_size;
+  for (uint32_t i = 0; i < hdr.pages; ++i, p += 4 + PAGE_SIZE) {
+    uint32_t addr;
+    memcpy(&addr, p, sizeof(addr));
+    if (addr >= MEM_LIMIT || addr & (PAGE_SIZE - 1) || mem_page(m, addr + 256)) {
+      err("'%s' is not a checkpoint from this build", filename);
+      fail(1);
+    }
+    memcpy(mem_page_alloc(m, addr), p + 4, PAGE_SIZE);
+  }
+}
+
+static inline void slots_add(struct slots *set, int slot)
+{
+  set->bits[slot >> 6] |= 1ull << (slot & 63);
+}
+
+static inline void slots_remove(struct slots *set, int slot)
+{
+  set->bits[slot >> 6] &= ~(1ull << (slot & 63));
+}
+
+/* nonzero if set holds a slot below slot, which may be WINDOW_SLOTS */
+static inline int slots_before(const struct slots *set, int slot)
+{
+  int w = slot >> 6;
+  for (int i = 0; i < w; ++i)
+    if (set->bits[i])
+      return 1;
+  return w < WINDOW_WORDS && set->bits[w] & ((1ull << (slot & 63)) - 1);
+}
+
+/* how many slots set holds below slot */
+static inline int slots_count(const struct slots *set, int slot)
+{
+  int n = 0;
+  for (int i = 0; i < slot >> 6; ++i)
+    n += __builtin_popcountll(set->bits[i]);
+  if (slot & 63)
+    n += __builtin_popcountll(set->bits[slot >> 6] & ((1ull << (slot & 63)) - 1));
+  return n;
+}
+
+/* the lowest slot in set at or above slot and below end, or -1 if there is
+   none; slots from end up to the next multiple of 64 must not be in set */
+static inline int slots_next(const struct slots *set, int slot, int end)
+{
+  for (int w = slot >> 6; w < (end + 63) >> 6; ++w) {
+    uint64_t bits = set->bits[w];
+    if (w == slot >> 6)
+      bits &= ~0ull << (slot & 63);
+    if (bits)
+      return w << 6 | __builtin_ctzll(bits);
+  }
+  return -1;
+}
+
+/* whether ins goes through the pre-issue queue, rather than being executed
+   by the IF unit (or being no instruction at all) */
+static inline int window_queues(int32_t ins)
+{
+  switch (opcode(ins)) {
+    case OP_sw:
+    case OP_add:
+    case OP_sub:
+    case OP_and:
+    case OP_or:
+    case OP_addi:
+    case OP_andi:
+    case OP_ori:
+    case OP_sll:
+    case OP_sra:
+    case OP_lw:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * The registers ins reads and writes as issue sees them, and those it may
+ * not take over from an older reader (war). sw writes none, but waits for
+ * older readers of the register it stores. Returns the class of ins.
+ */
+static inline int window_decode(int32_t ins, uint32_t *reads, uint32_t *writes, uint32_t *war)
+{
+  *reads = 1u << rs1(ins);
+  *writes = 1u << rd(ins);
+  *war = *writes;
+  switch (opcode(ins)) {
+    case OP_sw:
+      *reads |= 1u << rs2(ins);
+      *writes = 0;
+      *war = 1u << rs1(ins);
+      return ALU1;
+    case OP_lw:
+      return ALU1;
+    case OP_add:
+    case OP_sub:
+      *reads |= 1u << rs2(ins);
+      return ALU2;
+    case OP_addi:
+      return ALU2;
+    case OP_and:
+    case OP_or:
+      *reads |= 1u << rs2(ins);
+      return ALU3;
+    default:
+      return ALU3;
+  }
+}
+
+/* queue ins, fetched from pc, in the next slot, which the caller made sure is free */
+static inline void window_insert(struct window *w, int32_t ins, int32_t pc)
+{
+  int slot = w->tail++;
+  struct window_item *e = &w->items[slot];
+  e->ins = ins;
+  e->pc = pc;
+  e->class = window_decode(ins, &e->reads, &e->writes, &e->war);
+  ++w->count;
+  slots_add(&w->valid, slot);
+  if (opcode(ins) == OP_sw)
+    slots_add(&w->stores, slot);
+  for (uint32_t r = e->reads | e->writes; r; r &= r - 1)
+    slots_add(&w->uses[__builtin_ctz(r)], slot);
+  for (uint32_t r = e->writes; r; r &= r - 1)
+    slots_add(&w->writes[__builtin_ctz(r)], slot);
+  for (uint32_t r = e->reads; r; r &= r - 1)
+    slots_add(&w->reads[__builtin_ctz(r)], slot);
+}
+
+static inline void window_remove(struct window *w, int slot)
+{
+  const struct window_item *e = &w->items[slot];
+  --w->count;
+  slots_remove(&w->valid, slot);
+  slots_remove(&w->stores, slot);
+  for (uint32_t r = e->reads | e->writes; r; r &= r - 1)
+    slots_remove(&w->uses[__builtin_ctz(r)], slot);
+  for (uint32_t r = e->writes; r; r &= r - 1)
+    slots_remove(&w->writes[__builtin_ctz(r)], slot);
+  for (uint32_t r = e->reads; r; r &= r - 1)
+    slots_remove(&w->reads[__builtin_ctz(r)], slot);
+}
+
+/* drop the entries of w from slot up, which becomes the tail; returns how many there were */
+static int window_squash(struct window *w, int slot)
+{
+  int n = 0;
+  for (int s = slots_next(&w->valid, slot, w->tail); s >= 0; s = slots_next(&w->valid, s + 1, w->tail)) {
+    window_remove(w, s);
+    ++n;
+  }
+  w->tail = slot;
+  return n;
+}
+
+/* the entries of w oldest first, then zeros up to n */
+static void window_list(const struct window *w, int32_t *queue, int n)
+{
+  int i = 0;
+  for (int slot = slots_next(&w->valid, 0, w->tail); slot >= 0; slot = slots_next(&w->valid, slot + 1, w->tail))
+    queue[i++] = w->items[slot].ins;
+  for (; i < n; ++i)
+    queue[i] = 0;
+}
+
+/*
+ * The slots a window of n entries uses: twice n, so that compacting is
+ * rare, in whole words, so that the sets of a small window fit in one.
+ */
+static inline int window_span(int n)
+{
+  return (2 * n + 63) & ~63;
+}
+
+/* move the entries of w down to slots 0 up */
+static void __attribute__((noinline)) window_compact(struct window *w)
+{
+  struct window_item queue[MAX_PRE_ISSUE];
+  int n = 0;
+  for (int s = slots_next(&w->valid, 0, w->tail); s >= 0; s = slots_next(&w->valid, s + 1, w->tail)) {
+    queue[n++] = w->items[s];
+    window_remove(w, s);
+  }
+  w->tail = 0;
+  for (int i = 0; i < n; ++i)
+    window_insert(w, queue[i].ins, queue[i].pc);
+}
+
+static int32_t rget(const struct machine *m, int id)
+{
+  return m->regs[id];
+}
+
+static void rset(struct machine *m, int id, int32_t val)
+{
+  if (id) {
+    m->regs[id] = val;
+    m->willwrite &= ~(1 << id);
+  }
+}
+
+/* what issuing ins puts in its pre-ALU queue: the address and store value
+   for ALU1, the operands for ALU2 and ALU3 */
+static inline struct entry window_entry(const struct machine *m, const struct window_item *e)
+{
+  int32_t ins = e->ins;
+  switch (opcode(ins)) {
+    case OP_sw:
+      return (struct entry){ ins, rget(m, rs2(ins)) + imm1(ins), rget(m, rs1(ins)), e->pc };
+    case OP_lw:
+      return (struct entry){ ins, rget(m, rs1(ins)) + imm3(ins), 0, e->pc };
+    case OP_add:
+    case OP_sub:
+    case OP_and:
+    case OP_or:
+      return (struct entry){ ins, rget(m, rs1(ins)), rget(m, rs2(ins)), e->pc };
+    default:
+      return (struct entry){ ins, rget(m, rs1(ins)), imm3(ins), e->pc };
+  }
+}
+
+static void print_line(struct writer *out, const char *format, ...)
+{
+  char buf[256];
+  va_list ap;
+  va_start(ap, format);
+  int n = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  writer_write(out, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+/* xA, xB, #imm */
+static void print_rri(struct writer *out, int32_t a, int32_t b, int32_t imm)
+{
+  writer_putc(out, 'x');
+  writer_int(out, a);
+  writer_puts(out, ", x");
+  writer_int(out, b);
+  writer_puts(out, ", #");
+  writer_int(out, imm);
+}
+
+/* xA, xB, xC */
+static void print_rrr(struct writer *out, int32_t a, int32_t b, int32_t c)
+{
+  writer_putc(out, 'x');
+  writer_int(out, a);
+  writer_puts(out, ", x");
+  writer_int(out, b);
+  writer_puts(out, ", x");
+  writer_int(out, c);
+}
+
+/* xA, imm(xB) */
+static void print_mem(struct writer *out, int32_t a, int32_t imm, int32_t b)
+{
+  writer_putc(out, 'x');
+  writer_int(out, a);
+  writer_puts(out, ", ");
+  writer_int(out, imm);
+  writer_puts(out, "(x");
+  writer_int(out, b);
+  writer_putc(out, ')');
+}
+
+/* xA, #imm */
+static void print_ri(struct writer *out, int32_t a, int32_t imm)
+{
+  writer_putc(out, 'x');
+  writer_int(out, a);
+  writer_puts(out, ", #");
+  writer_int(out, imm);
+}
+
+static void print_instruction(struct writer *out, int32_t ins)
+{
+  if (!ins) {
+    writer_putc(out, '\n');
+    return;
+  }
+  writer_puts(out, " [");
+#define CASE(op, print, ...) case OP_ ## op: writer_puts(out, #op " "); print(out, __VA_ARGS__); break
+  switch (opcode(ins)) {
+    CASE(beq,   print_rri, rs1(ins), rs2(ins), imm1(ins));
+    CASE(bne,   print_rri, rs1(ins), rs2(ins), imm1(ins));
+    CASE(blt,   print_rri, rs1(ins), rs2(ins), imm1(ins));
+    CASE(sw,    print_mem, rs1(ins), imm1(ins), rs2(ins));
+    CASE(add,   print_rrr, rd(ins), rs1(ins), rs2(ins));
+    CASE(sub,   print_rrr, rd(ins), rs1(ins), rs2(ins));
+    CASE(and,   print_rrr, rd(ins), rs1(ins), rs2(ins));
+    CASE(or,    print_rrr, rd(ins), rs1(ins), rs2(ins));
+    CASE(addi,  print_rri, rd(ins), rs1(ins), imm3(ins));
+    CASE(andi,  print_rri, rd(ins), rs1(ins), imm3(ins));
+    CASE(ori,   print_rri, rd(ins), rs1(ins), imm3(ins));
+    CASE(sll,   print_rri, rd(ins), rs1(ins), imm3(ins));
+    CASE(sra,   print_rri, rd(ins), rs1(ins), imm3(ins));
+    CASE(lw,    print_mem, rd(ins), imm3(ins), rs1(ins));
+    CASE(jal,   print_ri,  rd(ins), imm4(ins));
+    case OP_break: writer_puts(out, "break");
+  }
+#undef CASE
+  writer_puts(out, "]\n");
+}
+
+static const char reg_labels[4][5] = { "x00:", "x08:", "x16:", "x24:" };
+
+/* a queue of n instructions, every stride'th int32_t from ins: inline if
+   it has one entry, one line per entry otherwise */
+static void print_queue(struct writer *out, const char *name, const int32_t *ins, int n, int stride)
+{
+  writer_write(out, name, strlen(name));
+  if (n == 1) {
+    print_instruction(out, *ins);
+    return;
+  }
+  writer_putc(out, '\n');
+  for (int i = 0; i < n; ++i) {
+    writer_puts(out, "\tEntry ");
+    writer_int(out, i);
+    writer_putc(out, ':');
+    print_instruction(out, ins[i * stride]);
+  }
+}
+
+#define ENTRY_STRIDE (int)(sizeof(struct entry) / sizeof(int32_t))
+
+static void print_cycle(struct writer *out, const struct machine *m)
+{
+  const struct config *c = &m->config;
+  writer_puts(out,
+    "--------------------\n"
+    "Cycle "
+  );
+  writer_int(out, m->cycle);
+  writer_puts(out,
+    ":\n"
+    "\n"
+    "IF Unit:\n"
+  );
+
+  writer_puts(out, "\tWaiting:");
+  print_instruction(out, m->branch);
+  writer_puts(out, "\tExecuted:");
+  print_instruction(out, m->executed);
+  if (config_equal(c, &config_default)) {
+    print_queue(out, "Pre-Issue Queue:", m->pre_issue, 4, 1);
+  } else {
+    int32_t queue[MAX_PRE_ISSUE];
+    window_list(&m->window, queue, c->pre_issue);
+    print_queue(out, "Pre-Issue Queue:", queue, c->pre_issue, 1);
+  }
+  print_queue(out, "Pre-ALU1 Queue:", &m->pre_alu[ALU1][0].ins, c->depth[ALU1], ENTRY_STRIDE);
+  print_queue(out, "Pre-MEM Queue:", &m->post_alu[ALU1][0].ins, c->units[ALU1], ENTRY_STRIDE);
+  print_queue(out, "Post-MEM Queue:", &m->post_mem[0].ins, c->units[ALU1], ENTRY_STRIDE);
+  print_queue(out, "Pre-ALU2 Queue:", &m->pre_alu[ALU2][0].ins, c->depth[ALU2], ENTRY_STRIDE);
+  print_queue(out, "Post-ALU2 Queue:", &m->post_alu[ALU2][0].ins, c->units[ALU2], ENTRY_STRIDE);
+  print_queue(out, "Pre-ALU3 Queue:", &m->pre_alu[ALU3][0].ins, c->depth[ALU3], ENTRY_STRIDE);
+  print_queue(out, "Post-ALU3 Queue:", &m->post_alu[ALU3][0].ins, c->units[ALU3], ENTRY_STRIDE);
+  writer_puts(out,
+    "\n"
+    "Registers\n"
+  );
+  for (int r = 0; r < 32; ++r) {
+    if (!(r & 7))
+      writer_write(out, reg_labels[r >> 3], 4);
+    writer_putc(out, '\t');
+    writer_int(out, m->regs[r]);
+    if ((r & 7) == 7)
+      writer_putc(out, '\n');
+  }
+  writer_puts(out, "Data");
+  for (int32_t addr = m->mem_data; addr < m->mem_end; addr += 4) {
+    if (!((addr - m->mem_data) & 31)) {
+      writer_putc(out, '\n');
+      writer_int(out, addr);
+      writer_putc(out, ':');
+    }
+    writer_putc(out, '\t');
+    writer_int(out, mem32(m, addr));
+  }
+  writer_putc(out, '\n');
+}
+
+/* the instruction slots shown in each cycle of the default pipeline, in
+   print order */
+static void get_slots(const struct machine *m, int32_t *slots)
+{
+  slots[0] = m->branch;
+  slots[1] = m->executed;
+  memcpy(slots + 2, m->pre_issue, sizeof(m->pre_issue));
+  slots[6] = m->pre_alu[ALU1][0].ins;
+  slots[7] = m->post_alu[ALU1][0].ins;
+  slots[8] = m->post_mem[0].ins;
+  slots[9] = m->pre_alu[ALU2][0].ins;
+  slots[10] = m->post_alu[ALU2][0].ins;
+  slots[11] = m->pre_alu[ALU3][0].ins;
+  slots[12] = m->post_alu[ALU3][0].ins;
+}
+
+static void set_slots(struct machine *m, const int32_t *slots)
+{
+  m->branch = slots[0];
+  m->executed = slots[1];
+  memcpy(m->pre_issue, slots + 2, sizeof(m->pre_issue));
+  m->pre_alu[ALU1][0].ins = slots[6];
+  m->post_alu[ALU1][0].ins = slots[7];
+  m->post_mem[0].ins = slots[8];
+  m->pre_alu[ALU2][0].ins = slots[9];
+  m->post_alu[ALU2][0].ins = slots[10];
+  m->pre_alu[ALU3][0].ins = slots[11];
+  m->post_alu[ALU3][0].ins = slots[12];
+}
+
+/*
+ * Delta trace records, one line per cycle:
+ *
+ *   K <cycle> <mem_data> <mem_end> <slots> <x0>..<x31> <data words>
+ *   [s<n>=<ins>] [r<n>=<value>] [@<addr>=<value>]
+ *
+ * Keyframes hold the complete state after that cycle; other lines hold only
+ * the slots, registers and data words the cycle changed.
+ */
+static void print_keyframe(struct writer *out, const struct machine *m, const int32_t *slots)
+{
+  writer_puts(out, "K ");
+  writer_int(out, m->cycle);
+  writer_putc(out, ' ');
+  writer_int(out, m->mem_data);
+  writer_putc(out, ' ');
+  writer_int(out, m->mem_end);
+  for (int i = 0; i < NSLOTS; ++i) {
+    writer_putc(out, ' ');
+    writer_int(out, slots[i]);
+  }
+  for (int r = 0; r < 32; ++r) {
+    writer_putc(out, ' ');
+    writer_int(out, m->regs[r]);
+  }
+  for (int32_t addr = m->mem_data; addr < m->mem_end; addr += 4) {
+    writer_putc(out, ' ');
+    writer_int(out, mem32(m, addr));
+  }
+  writer_putc(out, '\n');
+}
+
+static void print_change(struct writer *out, int *first, char kind, int32_t key, int32_t val)
+{
+  if (!*first)
+    writer_putc(out, ' ');
+  *first = 0;
+  writer_putc(out, kind);
+  writer_int(out, key);
+  writer_putc(out, '=');
+  writer_int(out, val);
+}
+
+static void print_delta(struct writer *out, const struct machine *m, const int32_t *prev_slots,
+                        const int32_t *prev_regs, const int32_t *slots)
+{
+  int first = 1;
+  for (int i = 0; i < NSLOTS; ++i) {
+    if (slots[i] != prev_slots[i])
+      print_change(out, &first, 's', i, slots[i]);
+  }
+  for (int r = 0; r < 32; ++r) {
+    if (m->regs[r] != prev_regs[r])
+      print_change(out, &first, 'r', r, m->regs[r]);
+  }
+  int32_t stored = m->stored;
+  if (stored >= m->mem_data && stored < m->mem_end && mem32(m, stored) != m->stored_old)
+    print_change(out, &first, '@', stored, mem32(m, stored));
+  writer_putc(out, '\n');
+}
+
+/* records hold the default pipeline, whose queues past the pre-issue one
+   have at most one entry in use */
+static void record_fill(struct trace_record *rec, const struct machine *m)
+{
+  const struct entry *alu1 = &m->pre_alu[ALU1][0], *mem = &m->post_alu[ALU1][0];
+  const struct entry *alu2 = &m->pre_alu[ALU2][0], *alu3 = &m->pre_alu[ALU3][0];
+  *rec = (struct trace_record){
+    .cycle = m->cycle,
+    .waiting = m->branch,
+    .executed = m->executed,
+    .pre_alu1_ins = alu1->ins, .pre_alu1_addr = alu1->a, .pre_alu1_val = alu1->b,
+    .pre_mem_ins = mem->ins, .pre_mem_addr = mem->a, .pre_mem_val = mem->b,
+    .post_mem_ins = m->post_mem[0].ins, .post_mem_val = m->post_mem[0].a,
+    .pre_alu2_ins = alu2->ins, .pre_alu2_lhs = alu2->a, .pre_alu2_rhs = alu2->b,
+    .post_alu2_ins = m->post_alu[ALU2][0].ins, .post_alu2_val = m->post_alu[ALU2][0].a,
+    .pre_alu3_ins = alu3->ins, .pre_alu3_lhs = alu3->a, .pre_alu3_rhs = alu3->b,
+    .post_alu3_ins = m->post_alu[ALU3][0].ins, .post_alu3_val = m->post_alu[ALU3][0].a,
+    .store_addr = m->stored,
+    .store_val = m->stored ? mem_peek(m, m->stored) : 0,
+  };
+  memcpy(rec->pre_issue, m->pre_issue, sizeof(rec->pre_issue));
+  memcpy(rec->regs, m->regs, sizeof(m->regs));
+}
+
+/* load the printed state in rec into m, whose data segment is a copy */
+static void record_apply(struct machine *m, const struct trace_record *rec)
+{
+  memcpy(m->pre_issue, rec->pre_issue, sizeof(rec->pre_issue));
+  m->pre_alu[ALU1][0] = (struct entry){ rec->pre_alu1_ins, rec->pre_alu1_addr, rec->pre_alu1_val };
+  m->post_alu[ALU1][0] = (struct entry){ rec->pre_mem_ins, rec->pre_mem_addr, rec->pre_mem_val };
+  m->post_mem[0] = (struct entry){ rec->post_mem_ins, rec->post_mem_val };
+  m->pre_alu[ALU2][0] = (struct entry){ rec->pre_alu2_ins, rec->pre_alu2_lhs, rec->pre_alu2_rhs };
+  m->post_alu[ALU2][0] = (struct entry){ rec->post_alu2_ins, rec->post_alu2_val };
+  m->pre_alu[ALU3][0] = (struct entry){ rec->pre_alu3_ins, rec->pre_alu3_lhs, rec->pre_alu3_rhs };
+  m->post_alu[ALU3][0] = (struct entry){ rec->post_alu3_ins, rec->post_alu3_val };
+  memcpy(m->regs, rec->regs, sizeof(m->regs));
+  if (rec->store_addr >= m->mem_data && rec->store_addr < m->mem_end)
+    mem32(m, rec->store_addr) = rec->store_val;
+  m->cycle = rec->cycle;
+  m->branch = rec->waiting;
+  m->executed = rec->executed;
+}
+
+static void print_record(struct writer *out, const struct machine *m)
+{
+  struct trace_record rec;
+  record_fill(&rec, m);
+  writer_write(out, &rec, sizeof(rec));
+}
+
+/*
+ * Full traces can be rendered off the simulation thread. The simulation
+ * fills chunks of trace records in a ring and publishes them by advancing
+ * head; it waits for a free slot when the ring is full, which bounds
+ * memory. Each formatter thread keeps its own copy of the data segment and
+ * reads every chunk to apply its stores, but renders only every nth chunk,
+ * so n formatters run in parallel. turn is the next chunk to be written,
+ * which keeps the output in order. The only synchronization is on the
+ * atomic counters; waiting spins with sched_yield().
+ */
+#define PIPE_RECORDS 64
+#define PIPE_CHUNKS 32
+#define PIPE_FORMATTERS 8
+
+struct pipe_chunk {
+  int count;
+  struct trace_record records[PIPE_RECORDS];
+};
+
+struct trace_pipe;
+
+struct pipe_formatter {
+  struct trace_pipe *pipe;
+  int id;
+  pthread_t thread;
+  /* the printed state, with a private copy of the data segment */
+  struct machine m;
+  /* chunks this formatter is done with */
+  _Atomic uint64_t tail;
+};
+
+struct trace_pipe {
+  struct pipe_chunk *chunks;
+  /* chunks published, whether the last one has been, and chunks written */
+  _Atomic uint64_t head;
+  _Atomic int closed;
+  _Atomic uint64_t turn;
+  /* producer side: records in the chunk being filled, and the head at
+     which the ring was last seen full */
+  int fill;
+  uint64_t free;
+  int fd;
+  int count;
+  struct pipe_formatter formatters[PIPE_FORMATTERS];
+};
+
+static void pipe_wait_turn(struct trace_pipe *pipe, uint64_t seq)
+{
+  while (atomic_load_explicit(&pipe->turn, memory_order_acquire) != seq)
+    sched_yield();
+}
+
+static void *pipe_format(void *arg)
+{
+  struct pipe_formatter *f = arg;
+  struct trace_pipe *pipe = f->pipe;
+  struct machine *m = &f->m;
+  struct writer out;
+  /* a generous bound on the text of one cycle */
+  size_t bound = 2048 + (size_t)(m->mem_end - m->mem_data) * 4;
+
+  writer_init(&out, pipe->fd);
+
+  for (uint64_t seq = 0; ; ++seq) {
+    while (seq == atomic_load_explicit(&pipe->head, memory_order_acquire)) {
+      if (atomic_load_explicit(&pipe->closed, memory_order_acquire)
+          && seq == atomic_load_explicit(&pipe->head, memory_order_acquire))
+        goto done;
+      sched_yield();
+    }
+    const struct pipe_chunk *chunk = &pipe->chunks[seq % PIPE_CHUNKS];
+    if (seq % pipe->count != (uint64_t)f->id) {
+      for (int i = 0; i < chunk->count; ++i)
+        record_apply(m, &chunk->records[i]);
+    } else {
+      /* render ahead of our turn while the text surely fits in the
+         buffer; past that, take the turn and let the writer flush */
+      int own = 0;
+      for (int i = 0; i < chunk->count; ++i) {
+        record_apply(m, &chunk->records[i]);
+        if (!own && out.len + bound > WRITER_SIZE) {
+          pipe_wait_turn(pipe, seq);
+          writer_flush(&out);
+          own = 1;
+        }
+        print_cycle(&out, m);
+      }
+      if (!own)
+        pipe_wait_turn(pipe, seq);
+      writer_flush(&out);
+      atomic_store_explicit(&pipe->turn, seq + 1, memory_order_release);
+    }
+    atomic_store_explicit(&f->tail, seq + 1, memory_order_release);
+  }
+done:
+  free(out.buf);
+  return NULL;
+}
+
+/* start count formatter threads writing the full trace of m to fd */
+static void pipe_open(struct trace_pipe *pipe, int fd, const struct machine *m, int count)
+{
+  pipe->chunks = malloc(PIPE_CHUNKS * sizeof(*pipe->chunks));
+  if (!pipe->chunks) {
+    err("could not allocate trace pipe");
+    fail(1);
+  }
+  atomic_init(&pipe->head, 0);
+  atomic_init(&pipe->closed, 0);
+  atomic_init(&pipe->turn, 0);
+  pipe->fill = 0;
+  pipe->free = PIPE_CHUNKS;
+  pipe->fd = fd;
+  pipe->count = count;
+  for (int i = 0; i < count; ++i) {
+    struct pipe_formatter *f = &pipe->formatters[i];
+    f->pipe = pipe;
+    f->id = i;
+    atomic_init(&f->tail, 0);
+    f->m = (struct machine){ .config = m->config, .mem_data = m->mem_data, .mem_end = m->mem_end };
+    f->m.mem = calloc((m->mem_end - 256) >> 2, sizeof(int32_t));
+    if (!f->m.mem) {
+      err("could not allocate memory");
+      fail(1);
+    }
+    memcpy(&mem32(&f->m, m->mem_data), &mem32(m, m->mem_data), m->mem_end - m->mem_data);
+    if ((errno = pthread_create(&f->thread, NULL, pipe_format, f))) {
+      err_sys("could not start formatter thread");
+      fail(1);
+    }
+  }
+  if (job)
+    job->pipe = pipe;
+}
+
+/* how far the slowest formatter has got */
+static uint64_t pipe_tail(struct trace_pipe *pipe)
+{
+  uint64_t tail = UINT64_MAX;
+  for (int i = 0; i < pipe->count; ++i) {
+    uint64_t t = atomic_load_explicit(&pipe->formatters[i].tail, memory_order_acquire);
+    if (t < tail)
+      tail = t;
+  }
+  return tail;
+}
+
+static void pipe_publish(struct trace_pipe *pipe)
+{
+  uint64_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+  pipe->chunks[head % PIPE_CHUNKS].count = pipe->fill;
+  atomic_store_explicit(&pipe->head, head + 1, memory_order_release);
+  pipe->fill = 0;
+}
+
+static inline void pipe_push(struct trace_pipe *pipe, const struct machine *m)
+{
+  uint64_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+  while (!pipe->fill && head == pipe->free) {
+    pipe->free = pipe_tail(pipe) + PIPE_CHUNKS;
+    if (head == pipe->free)
+      sched_yield();
+  }
+  record_fill(&pipe->chunks[head % PIPE_CHUNKS].records[pipe->fill], m);
+  if (++pipe->fill == PIPE_RECORDS)
+    pipe_publish(pipe);
+}
+
+/* publish what is left and wait until all of it has been written */
+static void pipe_close(struct trace_pipe *pipe)
+{
+  if (job && job->pipe == pipe)
+    job->pipe = NULL;
+  if (pipe->fill)
+    pipe_publish(pipe);
+  atomic_store_explicit(&pipe->closed, 1, memory_order_release);
+  for (int i = 0; i < pipe->count; ++i) {
+    pthread_join(pipe->formatters[i].thread, NULL);
+    free(pipe->formatters[i].m.mem);
+  }
+  free(pipe->chunks);
+}
+
+static void fail(int status)
+{
+  if (!job)
+    exit(status);
+  if (job->pipe)
+    pipe_close(job->pipe);
+  /* batches never verify, so these are all plain files */
+  for (struct writer *w = job->writers; w; w = w->next) {
+    close(w->fd);
+    free(w->buf);
+  }
+  if (job->machine)
+    program_unload(job->machine);
+  longjmp(job->env, status);
+}
+
+/*
+ * Count the pre-issue entry at index held back under its first cause, if it
+ * is the oldest one left (issued entries are removed, so index is 0). With
+ * no other cause, an older store holds it.
+ */
+static inline __attribute__((always_inline)) void count_stall(struct machine *m, int index, int unit, int busy,
+                                                              int32_t raw, int32_t waw, int32_t war)
+{
+  if (!index)
+    ++m->stats.stalls[busy ? unit : raw ? STALL_RAW : waw ? STALL_WAW : war ? STALL_WAR : STALL_STORE];
+}
+
+/* add n more cycles like the one that took the stats from prev to s */
+static void stats_repeat(struct stats *s, const struct stats *prev, int64_t n)
+{
+  int64_t *p = (int64_t *)s;
+  const int64_t *q = (const int64_t *)prev;
+  for (size_t i = 0; i < sizeof(*s) / sizeof(*p); ++i)
+    p[i] += (p[i] - q[i]) * n;
+}
+
+/* the counter of the predictor in cfg for the branch at pc */
+static inline uint8_t *predict_counter(struct machine *m, const struct config *cfg, int32_t pc)
+{
+  uint32_t index = (uint32_t)pc >> 2;
+  if (cfg->predictor == PREDICT_GSHARE)
+    index ^= m->bp_history;
+  return &m->bp_counters[index & ((1u << cfg->bp_bits) - 1)];
+}
+
+/* whether the predictor in cfg takes the branch ins at pc; counters start
+   out strongly not taken */
+static inline int predict(struct machine *m, const struct config *cfg, int32_t ins, int32_t pc)
+{
+  if (cfg->predictor == PREDICT_BTFN)
+    return imm1(ins) < 0;
+  return *predict_counter(m, cfg, pc) >= 2;
+}
+
+/* train the predictor in cfg on the branch at pc, which just resolved */
+static inline void predict_update(struct machine *m, const struct config *cfg, int32_t pc, int taken)
+{
+  if (cfg->predictor == PREDICT_BTFN)
+    return;
+  uint8_t *c = predict_counter(m, cfg, pc);
+  if (taken ? *c < 3 : *c > 0)
+    *c += taken ? 1 : -1;
+  m->bp_history = (m->bp_history << 1 | taken) & ((1u << cfg->bp_bits) - 1);
+}
+
+/* the D-cache statistics of the load or store at pc, or NULL if the table is full */
+static struct dcache_pc *dcache_pc(struct stats *s, int32_t pc)
+{
+  for (int i = 0; i < DCACHE_PCS; ++i) {
+    struct dcache_pc *p = &s->dcache_pcs[((pc >> 2) + i) & (DCACHE_PCS - 1)];
+    if (p->pc == pc)
+      return p;
+    if (!p->pc) {
+      p->pc = pc;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Access the D-cache line holding addr for the load or store at pc and make
+ * it the most recently used of its set, allocating it in place of the least
+ * recently used one on a miss. Stores only dirty the line; memory is always
+ * up to date, so evicting a dirty line costs no more than a clean one. A
+ * set is at most MAX_DCACHE_WAYS words, so the lookup is a short scan of
+ * one or two cache lines. Returns nonzero on a hit.
+ */
+static inline int dcache_access(struct machine *m, const struct config *cfg, int32_t addr, int store, int32_t pc)
+{
+  uint32_t line = (uint32_t)addr & -(uint32_t)cfg->dcache_line;
+  uint32_t *set = &m->dcache[(line >> __builtin_ctz(cfg->dcache_line) & (cfg->dcache_sets - 1)) * cfg->dcache_ways];
+  int way = 0;
+  while (way < cfg->dcache_ways && (set[way] | 2) != (line | 3))
+    ++way;
+  int hit = way < cfg->dcache_ways;
+  if (hit) {
+    line |= set[way] & 2;
+    ++m->stats.dcache_hits;
+  } else {
+    way = cfg->dcache_ways - 1;
+    m->stats.dcache_evictions += set[way] & 1;
+    m->stats.dcache_writebacks += set[way] >> 1 & 1;
+    ++m->stats.dcache_misses;
+  }
+  memmove(set + 1, set, way * sizeof(*set));
+  set[0] = line | store << 1 | 1;
+  struct dcache_pc *p = dcache_pc(&m->stats, pc);
+  if (p) {
+    ++p->accesses;
+    p->misses += !hit;
+  }
+  return hit;
+}
+
+/*
+ * Whether MEM must hold e, the oldest entry it has left this cycle, for the
+ * D-cache: from the cycle e misses until dcache_miss cycles later, when it
+ * completes as a hit would have.
+ */
+static inline int dcache_hold(struct machine *m, const struct config *cfg, const struct entry *e)
+{
+  if (m->dcache_wait)
+    return --m->dcache_wait != 0;
+  if (dcache_access(m, cfg, e->a, opcode(e->ins) == OP_sw, e->pc))
+    return 0;
+  m->dcache_wait = cfg->dcache_miss;
+  return 1;
+}
+
+/*
+ * Advance m by one clock cycle, fetching nothing new unless fetch is set.
+ * Returns nonzero once the cycle executed break, after which m must not be
+ * stepped again. This is the cycle of the default pipeline, written out for
+ * its shape; machine_cycle_config() below steps any other.
+ */
+static inline __attribute__((always_inline)) int machine_cycle_default(struct machine *m, int fetch)
+{
+  m->executed = 0;
+  m->stored = 0;
+  int32_t ins;
+  int32_t ww = m->willwrite;
+  int32_t wr = 0;
+  int has_store = 0;
+  int limit = 4;
+
+  /* Issue */
+  int i;
+  for (i = 0; i < 4 && (ins = m->pre_issue[i]); ++i) {
+    switch (opcode(ins)) {
+      case OP_sw:
+        if (m->latch[ALU1].ins || (ww | wr) & (1 << rs1(ins)) || ww & (1 << rs2(ins)) || has_store) {
+          count_stall(m, i, STALL_ALU1, m->latch[ALU1].ins, ww & ((1 << rs1(ins)) | (1 << rs2(ins))), 0,
+                      wr & (1 << rs1(ins)));
+          has_store = 1;
+          wr |= (1 << rs1(ins)) | (1 << rs2(ins));
+          continue;
+        }
+        m->latch[ALU1].ins = ins;
+        m->latch[ALU1].a = rget(m, rs2(ins)) + imm1(ins);
+        m->latch[ALU1].b = rget(m, rs1(ins));
+        break;
+      case OP_add:
+      case OP_sub:
+        if (m->latch[ALU2].ins || m->pre_alu[ALU2][0].ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins)) || ww & (1 << rs2(ins))) {
+          count_stall(m, i, STALL_ALU2, m->latch[ALU2].ins || m->pre_alu[ALU2][0].ins,
+                      ww & ((1 << rs1(ins)) | (1 << rs2(ins))), ww & (1 << rd(ins)), wr & (1 << rd(ins)));
+          ww |= 1 << rd(ins);
+          wr |= (1 << rs1(ins)) | (1 << rs2(ins));
+          continue;
+        }
+        m->latch[ALU2].ins = ins;
+        m->latch[ALU2].a = rget(m, rs1(ins));
+        m->latch[ALU2].b = rget(m, rs2(ins));
+        m->willwrite |= 1 << rd(ins);
+        break;
+      case OP_and:
+      case OP_or:
+        if (m->latch[ALU3].ins || m->pre_alu[ALU3][0].ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins)) || ww & (1 << rs2(ins))) {
+          count_stall(m, i, STALL_ALU3, m->latch[ALU3].ins || m->pre_alu[ALU3][0].ins,
+                      ww & ((1 << rs1(ins)) | (1 << rs2(ins))), ww & (1 << rd(ins)), wr & (1 << rd(ins)));
+          ww |= 1 << rd(ins);
+          wr |= (1 << rs1(ins)) | (1 << rs2(ins));
+          continue;
+        }
+        m->latch[ALU3].ins = ins;
+        m->latch[ALU3].a = rget(m, rs1(ins));
+        m->latch[ALU3].b = rget(m, rs2(ins));
+        m->willwrite |= 1 << rd(ins);
+        break;
+      case OP_addi:
+        if (m->latch[ALU2].ins || m->pre_alu[ALU2][0].ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins))) {
+          count_stall(m, i, STALL_ALU2, m->latch[ALU2].ins || m->pre_alu[ALU2][0].ins,
+                      ww & (1 << rs1(ins)), ww & (1 << rd(ins)), wr & (1 << rd(ins)));
+          ww |= 1 << rd(ins);
+          wr |= 1 << rs1(ins);
+          continue;
+        }
+        m->latch[ALU2].ins = ins;
+        m->latch[ALU2].a = rget(m, rs1(ins));
+        m->latch[ALU2].b = imm3(ins);
+        m->willwrite |= 1 << rd(ins);
+        break;
+      case OP_andi:
+      case OP_ori:
+      case OP_sll:
+      case OP_sra:
+        if (m->latch[ALU3].ins || m->pre_alu[ALU3][0].ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins))) {
+          count_stall(m, i, STALL_ALU3, m->latch[ALU3].ins || m->pre_alu[ALU3][0].ins,
+                      ww & (1 << rs1(ins)), ww & (1 << rd(ins)), wr & (1 << rd(ins)));
+          ww |= 1 << rd(ins);
+          wr |= 1 << rs1(ins);
+          continue;
+        }
+        m->latch[ALU3].ins = ins;
+        m->latch[ALU3].a = rget(m, rs1(ins));
+        m->latch[ALU3].b = imm3(ins);
+        m->willwrite |= 1 << rd(ins);
+        break;
+      case OP_lw:
+        if (m->latch[ALU1].ins || (ww | wr) & (1 << rd(ins)) || ww & (1 << rs1(ins)) || has_store) {
+          count_stall(m, i, STALL_ALU1, m->latch[ALU1].ins, ww & (1 << rs1(ins)), ww & (1 << rd(ins)), wr & (1 << rd(ins)));
+          ww |= 1 << rd(ins);
+          wr |= 1 << rs1(ins);
+          continue;
+        }
+        m->latch[ALU1].ins = ins;
+        m->latch[ALU1].a = rget(m, rs1(ins)) + imm3(ins);
+        m->willwrite |= 1 << rd(ins);
+        break;
+    }
+    ww |= m->willwrite;
+    for (int j = i; j < 3; ++j) {
+      m->pre_issue[j] = m->pre_issue[j + 1];
+    }
+    m->pre_issue[3] = 0;
+    --i;
+    --limit;
+  }
+  ++m->stats.issued[4 - limit];
+  int queued = i;
+
+  /* Fetch/Decode */
+  if (!fetch || m->branch) {
+    goto stop_fetch;
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    if (queued == limit) {
+      ++m->stats.fetch_full;
+      goto stop_fetch;
+    }
+    int32_t ins = mem_load(m, m->pc);
+    m->pc += 4;
+    switch (opcode(ins)) {
+      case OP_beq:
+      case OP_bne:
+      case OP_blt:
+        m->branch = ins;
+        goto stop_fetch;
+      case OP_sw:
+      case OP_add:
+      case OP_sub:
+      case OP_and:
+      case OP_or:
+      case OP_addi:
+      case OP_andi:
+      case OP_ori:
+      case OP_sll:
+      case OP_sra:
+      case OP_lw:
+        m->pre_issue[queued++] = ins;
+        /* a branch fetched after it in this pair must wait for its result */
+        if (opcode(ins) != OP_sw)
+          ww |= 1 << rd(ins);
+        break;
+      case OP_jal:
+        rset(m, rd(ins), m->pc);
+        m->pc = m->pc - 4 + (imm4(ins) << 1);
+        m->executed = ins;
+        goto stop_fetch;
+      case OP_break:
+        m->executed = ins;
+        goto stop_fetch;
+      default:
+        err("invalid opcode %d", opcode(ins));
+        fail(155);
+    }
+  }
+stop_fetch:
+
+  if (m->branch && !(ww & (1 << rs1(m->branch)) || ww & (1 << rs2(m->branch)))) {
+    switch (opcode(m->branch)) {
+      case OP_beq:
+        if (rget(m, rs1(m->branch)) == rget(m, rs2(m->branch)))
+          m->pc = m->pc - 4 + (imm1(m->branch) << 1);
+        break;
+      case OP_bne:
+        if (rget(m, rs1(m->branch)) != rget(m, rs2(m->branch)))
+          m->pc = m->pc - 4 + (imm1(m->branch) << 1);
+        break;
+      case OP_blt:
+        if (rget(m, rs1(m->branch)) < rget(m, rs2(m->branch)))
+          m->pc = m->pc - 4 + (imm1(m->branch) << 1);
+        break;
+    }
+    m->executed = m->branch;
+    m->branch = 0;
+  } else if (m->branch) {
+    ++m->stats.branch_wait;
+  }
+  if (m->executed)
+    ++m->retired;
+
+  /* WB */
+  if (m->post_mem[0].ins) {
+    rset(m, rd(m->post_mem[0].ins), m->post_mem[0].a);
+    m->post_mem[0].ins = 0;
+    ++m->retired;
+  }
+  if (m->post_alu[ALU2][0].ins) {
+    rset(m, rd(m->post_alu[ALU2][0].ins), m->post_alu[ALU2][0].a);
+    m->post_alu[ALU2][0].ins = 0;
+    ++m->retired;
+  }
+  if (m->post_alu[ALU3][0].ins) {
+    rset(m, rd(m->post_alu[ALU3][0].ins), m->post_alu[ALU3][0].a);
+    m->post_alu[ALU3][0].ins = 0;
+    ++m->retired;
+  }
+
+  /* MEM */
+  if (m->post_alu[ALU1][0].ins) {
+    ++m->stats.busy[3];
+    switch (opcode(m->post_alu[ALU1][0].ins)) {
+      case OP_lw:
+        m->post_mem[0].ins = m->post_alu[ALU1][0].ins;
+        m->post_mem[0].a = mem_load(m, m->post_alu[ALU1][0].a);
+        break;
+      case OP_sw:
+        m->stored = m->post_alu[ALU1][0].a;
+        m->stored_old = mem_load(m, m->post_alu[ALU1][0].a);
+        mem_store(m, m->post_alu[ALU1][0].a, m->post_alu[ALU1][0].b);
+        ++m->retired;
+        break;
+    }
+    m->post_alu[ALU1][0].ins = 0;
+  }
+
+  /* ALU3 */
+  if (m->pre_alu[ALU3][0].ins) {
+    ++m->stats.busy[2];
+    switch (opcode(m->pre_alu[ALU3][0].ins)) {
+      case OP_and:
+      case OP_andi:
+        m->post_alu[ALU3][0].a = m->pre_alu[ALU3][0].a & m->pre_alu[ALU3][0].b;
+        break;
+      case OP_or:
+      case OP_ori:
+        m->post_alu[ALU3][0].a = m->pre_alu[ALU3][0].a | m->pre_alu[ALU3][0].b;
+        break;
+      case OP_sll:
+        m->post_alu[ALU3][0].a = m->pre_alu[ALU3][0].a << m->pre_alu[ALU3][0].b;
+        break;
+      case OP_sra:
+        m->post_alu[ALU3][0].a = m->pre_alu[ALU3][0].a >> m->pre_alu[ALU3][0].b;
+        break;
+    }
+    m->post_alu[ALU3][0].ins = m->pre_alu[ALU3][0].ins;
+  }
+
+  /* ALU2 */
+  if (m->pre_alu[ALU2][0].ins) {
+    ++m->stats.busy[1];
+    switch (opcode(m->pre_alu[ALU2][0].ins)) {
+      case OP_add:
+      case OP_addi:
+        m->post_alu[ALU2][0].a = m->pre_alu[ALU2][0].a + m->pre_alu[ALU2][0].b;
+        break;
+      case OP_sub:
+        m->post_alu[ALU2][0].a = m->pre_alu[ALU2][0].a - m->pre_alu[ALU2][0].b;
+        break;
+    }
+    m->post_alu[ALU2][0].ins = m->pre_alu[ALU2][0].ins;
+  }
+
+  /* ALU1 */
+  if (m->pre_alu[ALU1][0].ins) {
+    ++m->stats.busy[0];
+    m->post_alu[ALU1][0].ins = m->pre_alu[ALU1][0].ins;
+    m->post_alu[ALU1][0].a = m->pre_alu[ALU1][0].a;
+    m->post_alu[ALU1][0].b = m->pre_alu[ALU1][0].b;
+  }
+
+  /* Issue */
+  m->pre_alu[ALU1][0] = m->latch[ALU1];
+  m->latch[ALU1].ins = 0;
+  m->pre_alu[ALU2][0] = m->latch[ALU2];
+  m->latch[ALU2].ins = 0;
+  m->pre_alu[ALU3][0] = m->latch[ALU3];
+  m->latch[ALU3].ins = 0;
+
+  ++m->stats.pre_issue[queued];
+
+  ++m->cycle;
+  return opcode(m->executed) == OP_break;
+}
+
+/*
+ * machine_cycle_default() for a pipeline of any shape cfg. The units of a
+ * class take the oldest entries of its queue, and issue adds the new ones
+ * behind those that are left. Callers pass cfg as a constant where they
+ * can, so the compiler can specialize the loops over queues and units.
+ */
+static inline __attribute__((always_inline)) int machine_cycle_config(struct machine *m, int fetch,
+                                                                      const struct config *cfg)
+{
+  m->executed = 0;
+  m->stored = 0;
+  struct window *w = &m->window;
+  int issued = 0;
+  /* per class: entries issue can add this cycle, those it added, and how
+     many of the queued ones the units took */
+  int room[3], taken[3] = { 0 }, done[3];
+  struct entry next[3][MAX_UNITS];
+
+  for (int c = 0; c < 3; ++c) {
+    int n = 0;
+    while (n < cfg->depth[c] && m->pre_alu[c][n].ins)
+      ++n;
+    room[c] = cfg->depth[c] - n < cfg->units[c] ? cfg->depth[c] - n : cfg->units[c];
+  }
+
+  /*
+   * Issue, oldest first, the entries none of whose registers is being
+   * written. An entry is held back by a full class, a register issue just
+   * claimed, or an older entry still queued that writes a register it uses,
+   * reads one it writes, or is a store it must follow. Of the entries held
+   * back, the oldest one left (head, while every older one has issued) counts
+   * a stall. Issue stops at the width. Entries fetched past a waiting branch
+   * (from end up) wait for it to resolve, neither issuing nor stalling.
+   */
+  int tail = w->tail;
+  int end = m->branch ? m->spec_slot : tail;
+  struct slots ready;
+  for (int i = 0; i < (tail + 63) >> 6; ++i) {
+    ready.bits[i] = w->valid.bits[i];
+    for (uint32_t r = m->willwrite; r; r &= r - 1)
+      ready.bits[i] &= ~w->uses[__builtin_ctz(r)].bits[i];
+  }
+  for (int i = end >> 6; end < tail && i < (tail + 63) >> 6; ++i)
+    ready.bits[i] &= i == end >> 6 ? (1ull << (end & 63)) - 1 : 0;
+  int head = slots_next(&w->valid, 0, tail);
+  if (head >= end)
+    head = -1;
+  for (int slot = slots_next(&ready, 0, tail); slot >= 0 && issued < cfg->issue;
+       slot = slots_next(&ready, slot + 1, tail)) {
+    if (head >= 0 && head < slot) {
+      const struct window_item *e = &w->items[head];
+      count_stall(m, 0, STALL_ALU1 + e->class, taken[e->class] == room[e->class],
+                  m->willwrite & e->reads, m->willwrite & e->writes, 0);
+      head = -1;
+    }
+    const struct window_item *e = &w->items[slot];
+    int c = e->class;
+    int busy = taken[c] == room[c];
+    int32_t raw = m->willwrite & e->reads, waw = m->willwrite & e->writes, war = 0;
+    int blocked = busy || raw || waw;
+    for (uint32_t r = e->reads | e->writes; r && !blocked; r &= r - 1)
+      if ((blocked = slots_before(&w->writes[__builtin_ctz(r)], slot))) {
+        raw = e->reads & (r & -r);
+        waw = !raw;
+      }
+    for (uint32_t r = e->war; r && !blocked; r &= r - 1)
+      blocked = war = slots_before(&w->reads[__builtin_ctz(r)], slot);
+    if (!blocked && c == ALU1)
+      blocked = slots_before(&w->stores, slot);
+    if (blocked) {
+      count_stall(m, slot != head, STALL_ALU1 + c, busy, raw, waw, war);
+      if (slot == head)
+        head = -1;
+      continue;
+    }
+    next[c][taken[c]++] = window_entry(m, e);
+    m->willwrite |= e->writes;
+    window_remove(w, slot);
+    if (slot == head && (head = slots_next(&w->valid, slot + 1, tail)) >= end)
+      head = -1;
+    ++issued;
+  }
+  if (issued < cfg->issue && head >= 0) {
+    const struct window_item *e = &w->items[head];
+    count_stall(m, 0, STALL_ALU1 + e->class, taken[e->class] == room[e->class],
+                m->willwrite & e->reads, m->willwrite & e->writes, 0);
+  }
+  ++m->stats.issued[issued];
+  int32_t ww = m->willwrite;
+  int queued = w->count;
+  /* entries issued this cycle are not free for fetch until the next */
+  int limit = cfg->pre_issue - issued;
+
+  /* Fetch/Decode; past a waiting branch, only what issue can take once it
+     resolves, up to the next instruction the IF unit would execute or
+     anything outside the program */
+  int speculating = m->branch != 0;
+  if (!fetch || (speculating && cfg->predictor == PREDICT_NONE)) {
+    goto stop_fetch;
+  }
+
+  /* compact once fetch could take the tail past the span of what is queued,
+     so that a lightly occupied window keeps to its first words */
+  int span = window_span(queued + cfg->fetch);
+  if (span > window_span(cfg->pre_issue))
+    span = window_span(cfg->pre_issue);
+  if (w->tail > span - cfg->fetch) {
+    if (speculating)
+      m->spec_slot = slots_count(&w->valid, m->spec_slot);
+    window_compact(w);
+  }
+  for (int i = 0; i < cfg->fetch; ++i) {
+    if (queued == limit) {
+      ++m->stats.fetch_full;
+      goto stop_fetch;
+    }
+    if (speculating && (mem_index(m->pc) >= m->mem_size / 4 || !window_queues(mem32(m, m->pc))))
+      goto stop_fetch;
+    int32_t ins = mem_load(m, m->pc);
+    m->pc += 4;
+    switch (opcode(ins)) {
+      case OP_beq:
+      case OP_bne:
+      case OP_blt:
+        m->branch = ins;
+        m->branch_pc = m->pc - 4;
+        m->spec_slot = w->tail;
+        if (cfg->predictor != PREDICT_NONE) {
+          m->spec_wait = 0;
+          m->spec_taken = predict(m, cfg, ins, m->branch_pc);
+          if (m->spec_taken)
+            m->pc = m->branch_pc + (imm1(ins) << 1);
+        }
+        goto stop_fetch;
+      case OP_sw:
+      case OP_add:
+      case OP_sub:
+      case OP_and:
+      case OP_or:
+      case OP_addi:
+      case OP_andi:
+      case OP_ori:
+      case OP_sll:
+      case OP_sra:
+      case OP_lw:
+        window_insert(w, ins, m->pc - 4);
+        ++queued;
+        /* a branch fetched after it in this pair must wait for its result */
+        if (opcode(ins) != OP_sw && !speculating)
+          ww |= 1 << rd(ins);
+        break;
+      case OP_jal:
+        rset(m, rd(ins), m->pc);
+        m->pc = m->pc - 4 + (imm4(ins) << 1);
+        m->executed = ins;
+        goto stop_fetch;
+      case OP_break:
+        m->executed = ins;
+        goto stop_fetch;
+      default:
+        err("invalid opcode %d", opcode(ins));
+        fail(155);
+    }
+  }
+stop_fetch:
+
+  /* every entry still queued ahead of a waiting branch that writes one of
+     its registers holds it back, however many issue passed over */
+  if (m->branch) {
+    if (slots_before(&w->writes[rs1(m->branch)], m->spec_slot))
+      ww |= 1 << rs1(m->branch);
+    if (slots_before(&w->writes[rs2(m->branch)], m->spec_slot))
+      ww |= 1 << rs2(m->branch);
+  }
+  if (m->branch && !(ww & (1 << rs1(m->branch)) || ww & (1 << rs2(m->branch)))) {
+    int taken = 0;
+    switch (opcode(m->branch)) {
+      case OP_beq:
+        taken = rget(m, rs1(m->branch)) == rget(m, rs2(m->branch));
+        break;
+      case OP_bne:
+        taken = rget(m, rs1(m->branch)) != rget(m, rs2(m->branch));
+        break;
+      case OP_blt:
+        taken = rget(m, rs1(m->branch)) < rget(m, rs2(m->branch));
+        break;
+    }
+    if (cfg->predictor != PREDICT_NONE) {
+      predict_update(m, cfg, m->branch_pc, taken);
+      ++m->stats.bp_branches;
+      if (taken == m->spec_taken) {
+        m->stats.bp_recovered += m->spec_wait;
+      } else {
+        ++m->stats.bp_mispredicts;
+        m->stats.bp_squashed += window_squash(w, m->spec_slot);
+        queued = w->count;
+      }
+    }
+    if (cfg->predictor == PREDICT_NONE || taken != m->spec_taken)
+      m->pc = m->branch_pc + (taken ? imm1(m->branch) << 1 : 4);
+    m->executed = m->branch;
+    m->branch = 0;
+  } else if (m->branch) {
+    ++m->stats.branch_wait;
+    ++m->spec_wait;
+  }
+  if (m->executed)
+    ++m->retired;
+
+  /* WB */
+  for (int u = 0; u < cfg->units[ALU1] && m->post_mem[u].ins; ++u) {
+    rset(m, rd(m->post_mem[u].ins), m->post_mem[u].a);
+    m->post_mem[u].ins = 0;
+    ++m->retired;
+  }
+  for (int c = ALU2; c <= ALU3; ++c) {
+    for (int u = 0; u < cfg->units[c] && m->post_alu[c][u].ins; ++u) {
+      rset(m, rd(m->post_alu[c][u].ins), m->post_alu[c][u].a);
+      m->post_alu[c][u].ins = 0;
+      ++m->retired;
+    }
+  }
+
+  /* MEM, in program order; an entry it holds for the D-cache holds all
+     younger ones too, and they move up to the front of the Pre-MEM queue */
+  int held = 0;
+  for (int u = 0, n = 0; u < cfg->units[ALU1] && m->post_alu[ALU1][u].ins; ++u) {
+    struct entry *e = &m->post_alu[ALU1][u];
+    ++m->stats.busy[3];
+    if (cfg->dcache_sets && dcache_hold(m, cfg, e)) {
+      ++m->stats.dcache_stalls;
+      for (; u < cfg->units[ALU1] && m->post_alu[ALU1][u].ins; ++u) {
+        struct dcache_pc *p = dcache_pc(&m->stats, m->post_alu[ALU1][u].pc);
+        if (p)
+          ++p->stalls;
+        m->post_alu[ALU1][held++] = m->post_alu[ALU1][u];
+      }
+      for (int j = held; j < u; ++j)
+        m->post_alu[ALU1][j].ins = 0;
+      break;
+    }
+    switch (opcode(e->ins)) {
+      case OP_lw:
+        m->post_mem[n++] = (struct entry){ e->ins, mem_load(m, e->a) };
+        break;
+      case OP_sw:
+        m->stored = e->a;
+        m->stored_old = mem_load(m, e->a);
+        mem_store(m, e->a, e->b);
+        ++m->retired;
+        break;
+    }
+    e->ins = 0;
+  }
+
+  /* ALU3 */
+  for (done[ALU3] = 0; done[ALU3] < cfg->units[ALU3] && m->pre_alu[ALU3][done[ALU3]].ins; ++done[ALU3]) {
+    const struct entry *e = &m->pre_alu[ALU3][done[ALU3]];
+    int32_t val = 0;
+    ++m->stats.busy[2];
+    switch (opcode(e->ins)) {
+      case OP_and:
+      case OP_andi:
+        val = e->a & e->b;
+        break;
+      case OP_or:
+      case OP_ori:
+        val = e->a | e->b;
+        break;
+      case OP_sll:
+        val = e->a << e->b;
+        break;
+      case OP_sra:
+        val = e->a >> e->b;
+        break;
+    }
+    m->post_alu[ALU3][done[ALU3]] = (struct entry){ e->ins, val };
+  }
+
+  /* ALU2 */
+  for (done[ALU2] = 0; done[ALU2] < cfg->units[ALU2] && m->pre_alu[ALU2][done[ALU2]].ins; ++done[ALU2]) {
+    const struct entry *e = &m->pre_alu[ALU2][done[ALU2]];
+    int32_t val = 0;
+    ++m->stats.busy[1];
+    switch (opcode(e->ins)) {
+      case OP_add:
+      case OP_addi:
+        val = e->a + e->b;
+        break;
+      case OP_sub:
+        val = e->a - e->b;
+        break;
+    }
+    m->post_alu[ALU2][done[ALU2]] = (struct entry){ e->ins, val };
+  }
+
+  /* ALU1, into what MEM left free */
+  for (done[ALU1] = 0; held + done[ALU1] < cfg->units[ALU1] && m->pre_alu[ALU1][done[ALU1]].ins; ++done[ALU1]) {
+    ++m->stats.busy[0];
+    m->post_alu[ALU1][held + done[ALU1]] = m->pre_alu[ALU1][done[ALU1]];
+  }
+
+  /* Issue: what the units left, then what was issued, and nothing after */
+  for (int c = 0; c < 3; ++c) {
+    int n = 0;
+    for (int j = done[c]; j < cfg->depth[c] && m->pre_alu[c][j].ins; ++j)
+      m->pre_alu[c][n++] = m->pre_alu[c][j];
+    for (int j = 0; j < taken[c]; ++j)
+      m->pre_alu[c][n++] = next[c][j];
+    for (; n < cfg->depth[c] && m->pre_alu[c][n].ins; ++n)
+      m->pre_alu[c][n].ins = 0;
+  }
+
+  ++m->stats.pre_issue[queued];
+
+  ++m->cycle;
+  return opcode(m->executed) == OP_break;
+}
+
+/* advance m, whose configuration is cfg, by one clock cycle */
+static inline __attribute__((always_inline)) int machine_cycle(struct machine *m, int fetch,
+                                                               const struct config *cfg)
+{
+  if (cfg == &config_default)
+    return machine_cycle_default(m, fetch);
+  return machine_cycle_config(m, fetch, cfg);
+}
+
+/* nothing between the IF unit and WB, and the IF unit executed nothing;
+   queues fill from entry 0, so that is all that needs looking at */
+static inline __attribute__((always_inline)) int machine_idle(const struct machine *m)
+{
+  return !(m->executed | m->pre_alu[ALU1][0].ins | m->post_alu[ALU1][0].ins | m->post_mem[0].ins
+           | m->pre_alu[ALU2][0].ins | m->post_alu[ALU2][0].ins | m->pre_alu[ALU3][0].ins
+           | m->post_alu[ALU3][0].ins);
+}
+
+/*
+ * Advance m by one cycle like machine_cycle(), setting *stuck if the cycle
+ * started and ended idle without moving the pc. No stage had any work then:
+ * nothing issued, fetched, resolved or wrote back, so every later cycle
+ * repeats this one exactly and only the cycle number changes.
+ */
+static inline __attribute__((always_inline)) int machine_cycle_stuck(struct machine *m, int fetch,
+                                                                     const struct config *cfg, int *stuck)
+{
+  int idle = machine_idle(m);
+  int32_t pc = m->pc;
+  int done = machine_cycle(m, fetch, cfg);
+  *stuck = idle && machine_idle(m) && m->pc == pc;
+  return done;
+}
+
+static void machine_stalled(const struct machine *m)
+{
+  err("pipeline stalled for good at cycle %d", m->cycle);
+  fail(1);
+}
+
+/*
+ * Run stmt with cfg pointing to m's configuration: to the constant copy if
+ * it is one of the shapes compiled as an instance of its own, which the
+ * compiler specializes to that shape, or to a local copy otherwise, which
+ * takes the generic instance.
+ */
+#define with_config(m, cfg, stmt)                                    \
+  do {                                                               \
+    if (config_equal(&(m)->config, &config_default)) {               \
+      const struct config *cfg = &config_default;                    \
+      stmt;                                                          \
+    } else if (config_equal(&(m)->config, &config_wide)) {           \
+      const struct config *cfg = &config_wide;                       \
+      stmt;                                                          \
+    } else {                                                         \
+      const struct config cfg##_copy = (m)->config, *cfg = &cfg##_copy; \
+      stmt;                                                          \
+    }                                                                \
+  } while (0)
+
+/*
+ * Run m until it executes break or completes cycle until (0 for no limit),
+ * tracing each cycle to out, and return nonzero if it executed break. trace
+ * is always a constant at the call site, so each instance carries only the
+ * formatting code it needs. Untraced runs print just the cycle that executes
+ * break, or nothing if out is NULL. Delta traces start with a keyframe, so
+ * a run can resume anywhere.
+ * m is checked for getting stuck every STUCK_INTERVAL cycles; once it is,
+ * the remaining cycles up to until are not simulated: they
+ * are counted off in bulk, and only traced runs print their (identical)
+ * blocks. A stuck run with no limit can never finish, so it is an error.
+ */
+static inline __attribute__((always_inline)) int machine_run(struct machine *m, const struct config *cfg,
+                                                             struct writer *out, struct trace_pipe *pipe,
+                                                             int trace, int until)
+{
+  int32_t slots[NSLOTS], prev_slots[NSLOTS], prev_regs[32];
+  int first = 1;
+  int stuck = 0;
+  int done = 0;
+
+  do {
+    if (stuck) {
+      if (trace == TRACE_NONE)
+        m->cycle = until;
+      else
+        ++m->cycle;
+    } else if (m->cycle % STUCK_INTERVAL) {
+      done = machine_cycle(m, 1, cfg);
+    } else {
+      struct stats prev = m->stats;
+      done = machine_cycle_stuck(m, 1, cfg, &stuck);
+      if (stuck && !until) {
+        if (trace == TRACE_PIPE)
+          pipe_close(pipe);
+        if (out)
+          writer_flush(out);
+        machine_stalled(m);
+      }
+      if (stuck)
+        stats_repeat(&m->stats, &prev, until - m->cycle);
+    }
+    if (trace == TRACE_DELTA) {
+      get_slots(m, slots);
+      if (first || m->cycle % DELTA_KEYFRAME_INTERVAL == 1)
+        print_keyframe(out, m, slots);
+      else
+        print_delta(out, m, prev_slots, prev_regs, slots);
+      memcpy(prev_slots, slots, sizeof(slots));
+      memcpy(prev_regs, m->regs, sizeof(prev_regs));
+    } else if (trace == TRACE_BINARY) {
+      print_record(out, m);
+    } else if (trace == TRACE_PIPE) {
+      pipe_push(pipe, m);
+    } else if (trace == TRACE_FULL || (done && out)) {
+      print_cycle(out, m);
+    }
+    first = 0;
+  } while (!done && m->cycle != until);
+  return done;
+}
+
+/* run m to completion, saving checkpoints of base as scheduled */
+static inline __attribute__((always_inline)) void program_run(struct machine *m, const struct config *cfg,
+                                                              struct writer *out, struct trace_pipe *pipe,
+                                                              int trace, const struct schedule *save,
+                                                              const char *base)
+{
+  char name[4096];
+  while (!machine_run(m, cfg, out, pipe, trace, next_checkpoint(save, m->cycle))) {
+    snprintf(name, sizeof(name), "%s.%d.ckpt", base, m->cycle);
+    checkpoint_save(m, name);
+  }
+}
+
+static int dcache_pc_compare(const void *a, const void *b)
+{
+  const struct dcache_pc *p = a, *q = b;
+  return (p->pc > q->pc) - (p->pc < q->pc);
+}
+
+/* the D-cache part of print_stats(), with the loads and stores in address order */
+static void print_dcache(struct writer *out, const struct machine *m)
+{
+  const struct stats *s = &m->stats;
+  const struct config *c = &m->config;
+  int64_t accesses = s->dcache_hits + s->dcache_misses;
+  struct dcache_pc pcs[DCACHE_PCS];
+  int n = 0;
+  for (int i = 0; i < DCACHE_PCS; ++i) {
+    if (s->dcache_pcs[i].pc)
+      pcs[n++] = s->dcache_pcs[i];
+  }
+  qsort(pcs, n, sizeof(*pcs), dcache_pc_compare);
+
+  print_line(out, "D-cache:\t%d sets, %d ways, %d-byte lines, %d-cycle misses\n", c->dcache_sets,
+             c->dcache_ways, c->dcache_line, c->dcache_miss);
+  print_line(out, "\tHits:\t%lld\n", (long long)s->dcache_hits);
+  print_line(out, "\tMisses:\t%lld (%.1f%%)\n", (long long)s->dcache_misses,
+             100.0 * s->dcache_misses / (accesses ? accesses : 1));
+  print_line(out, "\tEvictions:\t%lld (%lld dirty)\n", (long long)s->dcache_evictions,
+             (long long)s->dcache_writebacks);
+  print_line(out, "\tMiss stalls:\t%lld cycles\n", (long long)s->dcache_stalls);
+  writer_puts(out, "D-cache by PC:\tAccesses\tMisses\tStall cycles\n");
+  for (int i = 0; i < n; ++i) {
+    print_line(out, "\t%lld:\t%lld\t%lld (%.1f%%)\t%lld", (long long)pcs[i].pc, (long long)pcs[i].accesses,
+               (long long)pcs[i].misses, 100.0 * pcs[i].misses / (pcs[i].accesses ? pcs[i].accesses : 1),
+               (long long)pcs[i].stalls);
+    print_instruction(out, mem_peek(m, pcs[i].pc));
+  }
+  if (n == DCACHE_PCS)
+    print_line(out, "\t(loads and stores past the first %d are not listed)\n", DCACHE_PCS);
+}
+
+/* write the statistics m gathered over its run to filename */
+static void print_stats(const struct machine *m, const char *filename)
+{
+  static const char *const causes[NSTALLS] = {
+    "ALU1 busy", "ALU2 busy", "ALU3 busy", "RAW", "WAW", "WAR", "Store order",
+  };
+  static const char *const units[4] = { "ALU1", "ALU2", "ALU3", "MEM" };
+  const struct stats *s = &m->stats;
+  const struct config *c = &m->config;
+  double cycles = m->cycle ? m->cycle : 1;
+  int64_t issued = 0;
+  for (int i = 1; i <= c->issue; ++i)
+    issued += i * s->issued[i];
+
+  struct writer out;
+  writer_open(&out, filename);
+  print_line(&out, "Cycles:\t%d\n", m->cycle);
+  print_line(&out, "Instructions:\t%lld\n", (long long)m->retired);
+  print_line(&out, "IPC:\t%.4f\n", m->retired / cycles);
+  print_line(&out, "Issued:\t%lld\n", (long long)issued);
+  writer_puts(&out, "Issued per cycle:");
+  for (int i = 0; i <= c->issue; ++i)
+    print_line(&out, "\t%d: %lld", i, (long long)s->issued[i]);
+  writer_putc(&out, '\n');
+  writer_puts(&out, "Issue stalls:\n");
+  for (int i = 0; i < NSTALLS; ++i)
+    print_line(&out, "\t%s:\t%lld\n", causes[i], (long long)s->stalls[i]);
+  print_line(&out, "Branch waiting:\t%lld cycles\n", (long long)s->branch_wait);
+  print_line(&out, "Pre-Issue full:\t%lld cycles\n", (long long)s->fetch_full);
+  writer_puts(&out, "Pre-Issue occupancy:");
+  for (int i = 0; i <= c->pre_issue; ++i)
+    print_line(&out, "\t%d: %lld", i, (long long)s->pre_issue[i]);
+  writer_putc(&out, '\n');
+  /* as a share of the cycles all units of the class could have been busy */
+  writer_puts(&out, "Utilization:\n");
+  for (int i = 0; i < 4; ++i)
+    print_line(&out, "\t%s:\t%lld (%.1f%%)\n", units[i], (long long)s->busy[i],
+               100 * s->busy[i] / (cycles * c->units[i == 3 ? ALU1 : i]));
+  if (c->predictor != PREDICT_NONE) {
+    static const char *const predictors[] = { "none", "BTFN", "bimodal", "gshare" };
+    print_line(&out, "Branch prediction:\t%s", predictors[c->predictor]);
+    if (c->predictor != PREDICT_BTFN)
+      print_line(&out, ", %d counters", 1 << c->bp_bits);
+    print_line(&out, "\n\tBranches:\t%lld\n", (long long)s->bp_branches);
+    print_line(&out, "\tMispredicted:\t%lld (%.1f%% accurate)\n", (long long)s->bp_mispredicts,
+               100.0 * (s->bp_branches - s->bp_mispredicts) / (s->bp_branches ? s->bp_branches : 1));
+    print_line(&out, "\tRecovered:\t%lld cycles\n", (long long)s->bp_recovered);
+    print_line(&out, "\tSquashed:\t%lld entries\n", (long long)s->bp_squashed);
+  }
+  if (c->dcache_sets)
+    print_dcache(&out, m);
+  writer_close(&out);
+}
+
+static void program_simulate(struct machine *m, const char *filename, const char *expected,
+                             const char *stats, int trace, int formatters,
+                             const struct schedule *save, const char *base)
+{
+  /* trace records, and so the pipe, hold the default pipeline only */
+  if (!config_equal(&m->config, &config_default)) {
+    if (trace == TRACE_DELTA || trace == TRACE_BINARY) {
+      err("delta and binary traces need the default pipeline");
+      fail(1);
+    }
+    formatters = 0;
+  }
+  struct writer out;
+  writer_open_or_verify(&out, filename, expected);
+  switch (trace) {
+    case TRACE_NONE:
+      with_config(m, cfg, program_run(m, cfg, &out, NULL, TRACE_NONE, save, base));
+      break;
+    case TRACE_FULL:
+      if (formatters && !expected) {
+        struct trace_pipe pipe;
+        pipe_open(&pipe, out.fd, m, formatters);
+        program_run(m, &config_default, &out, &pipe, TRACE_PIPE, save, base);
+        pipe_close(&pipe);
+      } else {
+        with_config(m, cfg, program_run(m, cfg, &out, NULL, TRACE_FULL, save, base));
+      }
+      break;
+    case TRACE_DELTA:
+      writer_puts(&out, DELTA_MAGIC);
+      program_run(m, &config_default, &out, NULL, TRACE_DELTA, save, base);
+      break;
+    case TRACE_BINARY: {
+      struct trace_header hdr = {
+        .magic = BINARY_MAGIC,
+        .record_size = sizeof(struct trace_record),
+        .mem_data = m->mem_data,
+        .mem_end = m->mem_end,
+      };
+      writer_write(&out, &hdr, sizeof(hdr));
+      writer_write(&out, &mem32(m, m->mem_data), m->mem_end - m->mem_data);
+      program_run(m, &config_default, &out, NULL, TRACE_BINARY, save, base);
+      break;
+    }
+  }
+  writer_close(&out);
+  print_stats(m, stats);
+}
+
+/*
+ * Execute up to n instructions of m functionally, without timing. The
+ * pipeline must be empty. Returns nonzero if break was executed.
+ */
+static int machine_ff(struct machine *m, int64_t n)
+{
+  for (; n > 0; --n) {
+    int32_t ins = mem_load(m, m->pc);
+    m->pc += 4;
+    ++m->retired;
+    switch (opcode(ins)) {
+      case OP_beq:
+        if (rget(m, rs1(ins)) == rget(m, rs2(ins)))
+          m->pc = m->pc - 4 + (imm1(ins) << 1);
+        break;
+      case OP_bne:
+        if (rget(m, rs1(ins)) != rget(m, rs2(ins)))
+          m->pc = m->pc - 4 + (imm1(ins) << 1);
+        break;
+      case OP_blt:
+        if (rget(m, rs1(ins)) < rget(m, rs2(ins)))
+          m->pc = m->pc - 4 + (imm1(ins) << 1);
+        break;
+      case OP_sw:
+        mem_store(m, rget(m, rs2(ins)) + imm1(ins), rget(m, rs1(ins)));
+        break;
+      case OP_add:
+        rset(m, rd(ins), rget(m, rs1(ins)) + rget(m, rs2(ins)));
+        break;
+      case OP_sub:
+        rset(m, rd(ins), rget(m, rs1(ins)) - rget(m, rs2(ins)));
+        break;
+      case OP_and:
+        rset(m, rd(ins), rget(m, rs1(ins)) & rget(m, rs2(ins)));
+        break;
+      case OP_or:
+        rset(m, rd(ins), rget(m, rs1(ins)) | rget(m, rs2(ins)));
+        break;
+      case OP_addi:
+        rset(m, rd(ins), rget(m, rs1(ins)) + imm3(ins));
+        break;
+      case OP_andi:
+        rset(m, rd(ins), rget(m, rs1(ins)) & imm3(ins));
+        break;
+      case OP_ori:
+        rset(m, rd(ins), rget(m, rs1(ins)) | imm3(ins));
+        break;
+      case OP_sll:
+        rset(m, rd(ins), rget(m, rs1(ins)) << imm3(ins));
+        break;
+      case OP_sra:
+        rset(m, rd(ins), rget(m, rs1(ins)) >> imm3(ins));
+        break;
+      case OP_lw:
+        rset(m, rd(ins), mem_load(m, rget(m, rs1(ins)) + imm3(ins)));
+        break;
+      case OP_jal:
+        rset(m, rd(ins), m->pc);
+        m->pc = m->pc - 4 + (imm4(ins) << 1);
+        break;
+      case OP_break:
+        return 1;
+      default:
+        err("invalid opcode %d", opcode(ins));
+        fail(155);
+    }
+  }
+  return 0;
+}
+
+/* nothing is in flight, so m's architectural state is all there is */
+static int machine_drained(const struct machine *m)
+{
+  return !(m->branch | m->pre_issue[0] | m->window.count | m->pre_alu[ALU1][0].ins | m->post_alu[ALU1][0].ins
+           | m->post_mem[0].ins | m->pre_alu[ALU2][0].ins | m->post_alu[ALU2][0].ins
+           | m->pre_alu[ALU3][0].ins | m->post_alu[ALU3][0].ins);
+}
+
+/* run m in detail until it has completed n more instructions; nonzero at break */
+static inline __attribute__((always_inline)) int machine_detail(struct machine *m, const struct config *cfg,
+                                                                int64_t n)
+{
+  int64_t target = m->retired + n;
+  int stuck;
+  while (m->retired < target) {
+    if (machine_cycle_stuck(m, 1, cfg, &stuck))
+      return 1;
+    if (stuck)
+      machine_stalled(m);
+  }
+  return 0;
+}
+
+/* sampling parameters, in instructions */
+struct sampling {
+  int64_t period, warmup, window;
+};
+
+/*
+ * Sampled simulation: every period instructions, run warmup instructions in
+ * detail to fill the pipeline, then measure the cycles per instruction of the
+ * next window instructions, then drain the pipeline and fast-forward
+ * functionally to the next period. The program's instruction count is
+ * exact; its cycle count is that times the mean measured CPI, with a 95%
+ * confidence interval from the spread of the samples. If the period leaves
+ * nothing to fast-forward, the pipeline is never drained either, and the
+ * run is the same as a detailed one.
+ */
+static inline __attribute__((always_inline)) void program_sample_config(struct machine *m, const struct config *cfg,
+                                                                        const char *filename,
+                                                                        const struct sampling *p)
+{
+  int64_t samples = 0, detail_cycles = 0;
+  double sum = 0, sumsq = 0;
+  int done = 0;
+  int exact = 1;
+
+  while (!done) {
+    int start = m->cycle;
+    done = machine_detail(m, cfg, p->warmup);
+    if (!done) {
+      int64_t retired = m->retired;
+      int cycle = m->cycle;
+      done = machine_detail(m, cfg, p->window);
+      /* a window cut short by break is not a fair sample */
+      if (!done) {
+        double cpi = (double)(m->cycle - cycle) / (m->retired - retired);
+        sum += cpi;
+        sumsq += cpi * cpi;
+        ++samples;
+      }
+    }
+    if (!done && p->period > p->warmup + p->window) {
+      /* drain cycles are bubbles a detailed run never has */
+      exact = 0;
+      while (!done && !machine_drained(m)) {
+        int stuck;
+        done = machine_cycle_stuck(m, 0, cfg, &stuck);
+        if (stuck)
+          machine_stalled(m);
+      }
+      detail_cycles += m->cycle - start;
+      if (!done)
+        done = machine_ff(m, p->period - p->warmup - p->window);
+      continue;
+    }
+    detail_cycles += m->cycle - start;
+  }
+
+  struct writer out;
+  writer_open(&out, filename);
+  print_line(&out, "Instructions:\t%lld\n", (long long)m->retired);
+  print_line(&out, "Samples:\t%lld of %lld instructions every %lld (warmup %lld)\n",
+             (long long)samples, (long long)p->window, (long long)p->period, (long long)p->warmup);
+  print_line(&out, "Detailed cycles:\t%lld\n", (long long)detail_cycles);
+  if (exact) {
+    /* never fast-forwarded: every cycle was simulated */
+    print_line(&out, "Cycles:\t%d (exact)\n", m->cycle);
+  } else if (samples) {
+    double cpi = sum / samples;
+    double half = 0;
+    if (samples > 1) {
+      double var = (sumsq - sum * cpi) / (samples - 1);
+      half = 1.96 * sqrt(var > 0 ? var : 0) / sqrt(samples);
+    }
+    print_line(&out, "CPI:\t%.4f +/- %.4f\n", cpi, half);
+    print_line(&out, "IPC:\t%.4f [%.4f, %.4f]\n", 1 / cpi, 1 / (cpi + half),
+               cpi > half ? 1 / (cpi - half) : INFINITY);
+    print_line(&out, "Cycles:\t%.0f +/- %.0f\n", cpi * m->retired, half * m->retired);
+  } else {
+    print_line(&out, "CPI:\tno complete sample\n");
+  }
+  writer_close(&out);
+}
+
+static void program_sample(struct machine *m, const char *filename, const struct sampling *p)
+{
+  with_config(m, cfg, program_sample_config(m, cfg, filename, p));
+}
+
+/* parse a decimal integer at *p, skipping leading blanks */
+static int scan_int(const char **p, const char *end, int32_t *val)
+{
+  const char *s = *p;
+  int neg = 0;
+  int64_t v = 0;
+  while (s < end && *s == ' ')
+    ++s;
+  if (s < end && *s == '-') {
+    neg = 1;
+    ++s;
+  }
+  if (s == end || *s < '0' || *s > '9')
+    return -1;
+  while (s < end && *s >= '0' && *s <= '9')
+    v = v * 10 + (*s++ - '0');
+  *val = neg ? -v : v;
+  *p = s;
+  return 0;
+}
+
+/* regenerate the full text trace from a delta trace */
+static void program_expand(const char *input, const char *filename, const char *expected)
+{
+  struct stat st;
+  const char *p = map_file(input, &st);
+  size_t size = st.st_size;
+  const char *end = p + size;
+  struct machine machine = { .config = config_default }, *m = &machine;
+  int32_t slots[NSLOTS] = { 0 };
+  int32_t key, val;
+
+  if (size < sizeof(DELTA_MAGIC) - 1 || memcmp(p, DELTA_MAGIC, sizeof(DELTA_MAGIC) - 1)) {
+    err("'%s' is not a pipeline delta trace", input);
+    fail(1);
+  }
+  p += sizeof(DELTA_MAGIC) - 1;
+
+  struct writer out;
+  writer_open_or_verify(&out, filename, expected);
+
+  while (p < end) {
+    if (*p == 'K') {
+      int32_t new_data, new_end;
+      ++p;
+      if (scan_int(&p, end, &m->cycle) || scan_int(&p, end, &new_data) || scan_int(&p, end, &new_end))
+        goto malformed;
+      if (!m->mem) {
+        if (new_data < 256 || new_end < new_data || (new_end - new_data) & 3)
+          goto malformed;
+        m->mem_data = new_data;
+        m->mem_end = new_end;
+        m->mem = calloc((m->mem_end - 256) >> 2, sizeof(int32_t));
+        if (!m->mem) {
+          err("could not allocate memory");
+          fail(1);
+        }
+      } else if (new_data != m->mem_data || new_end != m->mem_end) {
+        goto malformed;
+      }
+      for (int i = 0; i < NSLOTS; ++i)
+        if (scan_int(&p, end, &slots[i]))
+          goto malformed;
+      for (int r = 0; r < 32; ++r)
+        if (scan_int(&p, end, &m->regs[r]))
+          goto malformed;
+      for (int32_t addr = m->mem_data; addr < m->mem_end; addr += 4)
+        if (scan_int(&p, end, &mem32(m, addr)))
+          goto malformed;
+    } else {
+      if (!m->mem)
+        goto malformed;
+      ++m->cycle;
+      while (p < end && *p != '\n') {
+        char kind = *p++;
+        if (scan_int(&p, end, &key) || p == end || *p++ != '=' || scan_int(&p, end, &val))
+          goto malformed;
+        if (kind == 's' && key >= 0 && key < NSLOTS)
+          slots[key] = val;
+        else if (kind == 'r' && key >= 0 && key < 32)
+          m->regs[key] = val;
+        else if (kind == '@' && key >= m->mem_data && key < m->mem_end)
+          mem32(m, key) = val;
+        else
+          goto malformed;
+        if (p < end && *p == ' ')
+          ++p;
+      }
+    }
+    if (p == end || *p++ != '\n')
+      goto malformed;
+    set_slots(m, slots);
+    print_cycle(&out, m);
+  }
+
+  writer_close(&out);
+  return;
+
+malformed:
+  err("malformed delta trace after cycle %d", m->cycle);
+  fail(1);
+}
+
+/* render a binary trace as the classic text trace */
+static void program_render(const char *input, const char *filename, const char *expected)
+{
+  struct stat st;
+  const char *data = map_file(input, &st);
+  size_t size = st.st_size;
+  const struct trace_header *hdr = (const void *)data;
+  struct machine machine = { .config = config_default }, *m = &machine;
+
+  if (size < sizeof(*hdr) || memcmp(hdr->magic, BINARY_MAGIC, 8)
+      || hdr->record_size != sizeof(struct trace_record)
+      || hdr->mem_data < 256 || hdr->mem_end < hdr->mem_data || (hdr->mem_end - hdr->mem_data) & 3
+      || size < sizeof(*hdr) + (hdr->mem_end - hdr->mem_data)) {
+    err("'%s' is not a binary trace", input);
+    fail(1);
+  }
+  m->mem_data = hdr->mem_data;
+  m->mem_end = hdr->mem_end;
+  m->mem = calloc((m->mem_end - 256) >> 2, sizeof(int32_t));
+  if (!m->mem) {
+    err("could not allocate memory");
+    fail(1);
+  }
+  memcpy(&mem32(m, m->mem_data), data + sizeof(*hdr), m->mem_end - m->mem_data);
+
+  const char *p = data + sizeof(*hdr) + (m->mem_end - m->mem_data);
+  const char *end = data + size;
+  struct writer out;
+  writer_open_or_verify(&out, filename, expected);
+
+  for (; end - p >= (ptrdiff_t)sizeof(struct trace_record); p += sizeof(struct trace_record)) {
+    struct trace_record rec;
+    memcpy(&rec, p, sizeof(rec));
+    record_apply(m, &rec);
+    print_cycle(&out, m);
+  }
+  if (p != end) {
+    err("'%s' ends with a partial record", input);
+    fail(1);
+  }
+
+  writer_close(&out);
+}
+
+/*
+ * Batch mode: each input is loaded and simulated on its own, and written to
+ * <input>.simulation.txt (or .delta/.bin) beside it or in outdir. Inputs are
+ * split evenly between the workers; a worker runs its share from the front
+ * and, when it is done, steals from the back of another worker's share.
+ */
+struct batch_queue {
+  pthread_mutex_t lock;
+  size_t head, tail;
+};
+
+struct batch {
+  char **inputs;
+  size_t count;
+  const char *outdir;
+  const char *output;
+  int cache, trace, formatters, resume;
+  const struct config *config;
+  const struct schedule *save;
+  const struct sampling *sampling;
+  unsigned workers;
+  struct batch_queue *queues;
+  /* inputs that failed, each of which err() already reported */
+  atomic_size_t failed;
+};
+
+struct batch_worker {
+  struct batch *batch;
+  unsigned id;
+  pthread_t thread;
+  /* off the worker's stack, which longjmp() leaves indeterminate */
+  struct machine machine;
+};
+
+static int batch_take(struct batch *batch, unsigned id, size_t *index)
+{
+  for (unsigned i = 0; i < batch->workers; ++i) {
+    struct batch_queue *q = &batch->queues[(id + i) % batch->workers];
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+      *index = i ? --q->tail : q->head++;
+      found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (found)
+      return 1;
+  }
+  return 0;
+}
+
+/* name the output of one input, in batch->outdir if given */
+static void batch_output(char *filename, size_t size, const struct batch *batch,
+                         const char *input, const char *output)
+{
+  if (batch->outdir) {
+    const char *base = strrchr(input, '/');
+    snprintf(filename, size, "%s/%s.%s", batch->outdir, base ? base + 1 : input, output);
+  } else {
+    snprintf(filename, size, "%s.%s", input, output);
+  }
+}
+
+static void *batch_worker(void *arg)
+{
+  struct batch_worker *worker = arg;
+  struct batch *batch = worker->batch;
+  char filename[4096], stats[4096], image[4096], base[4096];
+  struct machine *machine = &worker->machine;
+  size_t index;
+
+  while (batch_take(batch, worker->id, &index)) {
+    const char *input = batch->inputs[index];
+    struct job this_job = { .writers = NULL, .pipe = NULL, .machine = NULL };
+    if (setjmp(this_job.env)) {
+      job = NULL;
+      err("'%s' failed; the batch goes on", input);
+      atomic_fetch_add(&batch->failed, 1);
+      continue;
+    }
+    job = &this_job;
+    batch_output(filename, sizeof(filename), batch, input, batch->output);
+    batch_output(stats, sizeof(stats), batch, input, "statistics.txt");
+    snprintf(image, sizeof(image), "%s.img", input);
+    if (batch->resume)
+      checkpoint_load(machine, input);
+    else
+      program_load(machine, input, batch->cache ? image : NULL, batch->config);
+    checkpoint_base(base, sizeof(base), input);
+    if (batch->sampling)
+      program_sample(machine, filename, batch->sampling);
+    else
+      program_simulate(machine, filename, NULL, stats, batch->trace, batch->formatters, batch->save, base);
+    job = NULL;
+    program_unload(machine);
+  }
+  return NULL;
+}
+
+/* run every input of batch; returns how many failed */
+static size_t program_batch(struct batch *batch)
+{
+  if (batch->workers > batch->count)
+    batch->workers = batch->count ? batch->count : 1;
+  struct batch_worker *workers = calloc(batch->workers, sizeof(*workers));
+  batch->queues = calloc(batch->workers, sizeof(*batch->queues));
+  if (!workers || !batch->queues) {
+    err("could not allocate workers");
+    fail(1);
+  }
+  atomic_init(&batch->failed, 0);
+  for (unsigned i = 0; i < batch->workers; ++i) {
+    pthread_mutex_init(&batch->queues[i].lock, NULL);
+    batch->queues[i].head = batch->count * i / batch->workers;
+    batch->queues[i].tail = batch->count * (i + 1) / batch->workers;
+    workers[i].batch = batch;
+    workers[i].id = i;
+  }
+
+  /* this thread is worker 0; if a thread can't start, the rest steal its share */
+  unsigned started = 1;
+  for (; started < batch->workers; ++started) {
+    int error = pthread_create(&workers[started].thread, NULL, batch_worker, &workers[started]);
+    if (error) {
+      err("could not start worker: %s", strerror(error));
+      break;
+    }
+  }
+  batch_worker(&workers[0]);
+  for (unsigned i = 1; i < started; ++i)
+    pthread_join(workers[i].thread, NULL);
+
+  for (unsigned i = 0; i < batch->workers; ++i)
+    pthread_mutex_destroy(&batch->queues[i].lock);
+  free(batch->queues);
+  free(workers);
+  return atomic_load(&batch->failed);
+}
+
+/*
+ * Sweep mode: one program run untraced under each of count configurations.
+ * The program is parsed once into proto, whose memory every run maps
+ * copy-on-write from fd. Workers take the next configuration in turn and
+ * leave the finished machine in runs[], which is written out in order.
+ * Each run is a job stopped at cycle limit, so a configuration that fails
+ * or never reaches break costs only its own row.
+ */
+struct sweep {
+  const struct machine *proto;
+  int fd;
+  const struct config *configs;
+  char **specs;
+  struct machine *runs;
+  /* how each run ended, one of SWEEP_* */
+  unsigned char *results;
+  size_t count;
+  int limit;
+  atomic_size_t next;
+  /* runs that failed, each of which err() already reported */
+  atomic_size_t failed;
+};
+
+enum { SWEEP_LIMIT, SWEEP_BREAK, SWEEP_FAILED };
+
+/* the cycles a sweep run may take without -l */
+#define SWEEP_CYCLES 100000000
+
+/* the result column of sweep.csv, by SWEEP_* */
+static const char *const sweep_results[] = { "cycle limit", "break", "failed" };
+
+static void *sweep_worker(void *arg)
+{
+  struct sweep *sweep = arg;
+  size_t index;
+  while ((index = atomic_fetch_add(&sweep->next, 1)) < sweep->count) {
+    struct machine *m = &sweep->runs[index];
+    struct job this_job = { .writers = NULL, .pipe = NULL, .machine = NULL };
+    if (setjmp(this_job.env)) {
+      job = NULL;
+      err("configuration '%s' failed; the sweep goes on", sweep->specs[index]);
+      sweep->results[index] = SWEEP_FAILED;
+      atomic_fetch_add(&sweep->failed, 1);
+      continue;
+    }
+    job = &this_job;
+    program_clone(m, sweep->proto, sweep->fd, &sweep->configs[index]);
+    int done;
+    with_config(m, cfg, done = machine_run(m, cfg, NULL, NULL, TRACE_NONE, sweep->limit));
+    sweep->results[index] = done ? SWEEP_BREAK : SWEEP_LIMIT;
+    job = NULL;
+    program_unload(m);
+  }
+  return NULL;
+}
+
+/* one line per run: its configuration, the statistics print_stats() gives,
+   then how it ended */
+static void sweep_write(const struct sweep *sweep, const char *filename)
+{
+  struct writer out;
+  writer_open(&out, filename);
+  writer_puts(&out, "config");
+  for (size_t i = 0; i < sizeof(config_fields) / sizeof(*config_fields); ++i)
+    print_line(&out, ",%s", config_fields[i].name);
+  writer_puts(&out, ",cycles,instructions,ipc,issued"
+                    ",alu1 busy,alu2 busy,alu3 busy,raw,waw,war,store order"
+                    ",branch waiting,pre-issue full"
+                    ",alu1 utilization,alu2 utilization,alu3 utilization,mem utilization"
+                    ",dcache hits,dcache misses,dcache evictions,dcache dirty evictions,dcache stalls"
+                    ",branches predicted,mispredicted,recovered cycles,squashed,result\n");
+  for (size_t r = 0; r < sweep->count; ++r) {
+    const struct machine *m = &sweep->runs[r];
+    const struct stats *s = &m->stats;
+    const struct config *c = &m->config;
+    double cycles = m->cycle ? m->cycle : 1;
+    int64_t issued = 0;
+    for (int i = 1; i <= c->issue; ++i)
+      issued += i * s->issued[i];
+    /* specs are config_parse() items, which hold no quotes */
+    print_line(&out, "\"%s\"", sweep->specs[r]);
+    for (size_t i = 0; i < sizeof(config_fields) / sizeof(*config_fields); ++i)
+      print_line(&out, ",%d", config_field(c, i));
+    print_line(&out, ",%d,%lld,%.4f,%lld", m->cycle, (long long)m->retired, m->retired / cycles,
+               (long long)issued);
+    for (int i = 0; i < NSTALLS; ++i)
+      print_line(&out, ",%lld", (long long)s->stalls[i]);
+    print_line(&out, ",%lld,%lld", (long long)s->branch_wait, (long long)s->fetch_full);
+    for (int i = 0; i < 4; ++i)
+      print_line(&out, ",%.4f", s->busy[i] / (cycles * c->units[i == 3 ? ALU1 : i]));
+    print_line(&out, ",%lld,%lld,%lld,%lld,%lld", (long long)s->dcache_hits, (long long)s->dcache_misses,
+               (long long)s->dcache_evictions, (long long)s->dcache_writebacks, (long long)s->dcache_stalls);
+    print_line(&out, ",%lld,%lld,%lld,%lld", (long long)s->bp_branches, (long long)s->bp_mispredicts,
+               (long long)s->bp_recovered, (long long)s->bp_squashed);
+    print_line(&out, ",%s\n", sweep_results[sweep->results[r]]);
+  }
+  writer_close(&out);
+}
+
+/* run filename under each of configs[count] for up to limit cycles, on up to
+   workers threads; returns how many runs failed */
+static size_t program_sweep(const char *filename, const char *image, const struct config *configs,
+                            char **specs, size_t count, int limit, unsigned workers, const char *output)
+{
+  struct machine proto;
+  program_load(&proto, filename, image, &config_default);
+  struct sweep sweep = {
+    .proto = &proto,
+    .fd = program_share(&proto),
+    .configs = configs,
+    .specs = specs,
+    .runs = calloc(count, sizeof(struct machine)),
+    .results = calloc(count, 1),
+    .count = count,
+    .limit = limit,
+  };
+  atomic_init(&sweep.next, 0);
+  atomic_init(&sweep.failed, 0);
+  if (workers > count)
+    workers = count ? count : 1;
+  pthread_t *threads = calloc(workers, sizeof(*threads));
+  if (!sweep.runs || !sweep.results || !threads) {
+    err("could not allocate workers");
+    fail(1);
+  }
+  program_unload(&proto);
+
+  /* this thread is a worker too; the rest take up any that can't start */
+  unsigned started = 1;
+  for (; started < workers; ++started) {
+    int error = pthread_create(&threads[started], NULL, sweep_worker, &sweep);
+    if (error) {
+      err("could not start worker: %s", strerror(error));
+      break;
+    }
+  }
+  sweep_worker(&sweep);
+  for (unsigned i = 1; i < started; ++i)
+    pthread_join(threads[i], NULL);
+
+  close(sweep.fd);
+  sweep_write(&sweep, output);
+  free(threads);
+  free(sweep.runs);
+  free(sweep.results);
+  return atomic_load(&sweep.failed);
+}
+
+/* append the lines of list ("-" for stdin) to inputs */
+static void read_list(const char *list, char ***inputs, size_t *count)
+{
+  FILE *f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+  if (!f) {
+    err_sys("could not open '%s'", list);
+    fail(1);
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, f)) != -1) {
+    if (len && line[len - 1] == '\n')
+      line[--len] = 0;
+    if (!len)
+      continue;
+    *inputs = realloc(*inputs, (*count + 1) * sizeof(**inputs));
+    if (!*inputs || !((*inputs)[(*count)++] = strdup(line))) {
+      err("could not allocate input list");
+      fail(1);
+    }
+  }
+  if (ferror(f)) {
+    err_sys("could not read '%s'", list);
+    fail(1);
+  }
+  free(line);
+  if (f != stdin)
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+  int trace = TRACE_FULL;
+  int expand = 0;
+  int render = 0;
+  int cache = 0;
+  int resume = 0;
+  long formatters = -1;
+  struct schedule save = { NULL, 0, 0 };
+  struct sampling sampling = { 0, 1000, 1000 };
+  struct config config = config_default;
+  int configured = 0;
+  int batch_mode = 0;
+  long jobs = 0;
+  const char *outdir = NULL;
+  const char *expected = NULL;
+  int sweep = 0;
+  long limit = 0;
+  char **specs = NULL;
+  size_t sweeps = 0;
+  char **inputs = NULL;
+  size_t count = 0;
+  int lists = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "cqdbf:j:l:L:m:o:s:i:kp:v:w:xr")) != -1) {
+    switch (opt) {
+      case 'c':
+        cache = 1;
+        break;
+      case 'q':
+        trace = TRACE_NONE;
+        break;
+      case 'd':
+        trace = TRACE_DELTA;
+        break;
+      case 'b':
+        trace = TRACE_BINARY;
+        break;
+      case 'f': {
+        char *q;
+        formatters = strtol(optarg, &q, 10);
+        if (q == optarg || *q || formatters < 0 || formatters > PIPE_FORMATTERS) {
+          err("invalid formatter count '%s'", optarg);
+          return 2;
+        }
+        break;
+      }
+      case 'j': {
+        char *q;
+        jobs = strtol(optarg, &q, 10);
+        if (q == optarg || *q || jobs < 1) {
+          err("invalid job count '%s'", optarg);
+          return 2;
+        }
+        batch_mode = 1;
+        break;
+      }
+      case 'l': {
+        char *q;
+        limit = strtol(optarg, &q, 10);
+        if (q == optarg || *q || limit < 1 || limit > INT32_MAX) {
+          err("invalid cycle limit '%s'", optarg);
+          return 2;
+        }
+        break;
+      }
+      case 'L':
+        read_list(optarg, &inputs, &count);
+        ++lists;
+        batch_mode = 1;
+        break;
+      case 'm':
+        if (config_parse(&config, optarg)) {
+          err("invalid pipeline configuration '%s'", optarg);
+          return 2;
+        }
+        configured = 1;
+        break;
+      case 'o':
+        outdir = optarg;
+        batch_mode = 1;
+        break;
+      case 's':
+        for (char *p = optarg, *q; *p; p = q + (*q == ',')) {
+          long cycle = strtol(p, &q, 10);
+          if (q == p || cycle < 1 || cycle > INT32_MAX || (*q && *q != ',')) {
+            err("invalid checkpoint cycles '%s'", optarg);
+            return 2;
+          }
+          save.cycles = realloc(save.cycles, (save.count + 1) * sizeof(*save.cycles));
+          if (!save.cycles) {
+            err("could not allocate checkpoint list");
+            return 1;
+          }
+          save.cycles[save.count++] = cycle;
+        }
+        break;
+      case 'i':
+        save.interval = strtol(optarg, NULL, 10);
+        if (save.interval < 1) {
+          err("invalid checkpoint interval '%s'", optarg);
+          return 2;
+        }
+        break;
+      case 'k':
+        resume = 1;
+        break;
+      case 'p': {
+        char *q;
+        sampling.period = strtoll(optarg, &q, 10);
+        if (*q == ',')
+          sampling.warmup = strtoll(q + 1, &q, 10);
+        if (*q == ',')
+          sampling.window = strtoll(q + 1, &q, 10);
+        if (*q || sampling.warmup < 0 || sampling.window < 1
+            || sampling.period < sampling.warmup + sampling.window) {
+          err("invalid sampling '%s'", optarg);
+          return 2;
+        }
+        break;
+      }
+      case 'v':
+        expected = optarg;
+        break;
+      case 'w':
+        read_list(optarg, &specs, &sweeps);
+        sweep = 1;
+        break;
+      case 'x':
+        expand = 1;
+        break;
+      case 'r':
+        render = 1;
+        break;
+      default:
+        return 2;
+    }
+  }
+
+  if (argc - optind > 1)
+    batch_mode = 1;
+  if (batch_mode && (expand || render)) {
+    err("-x and -r take a single filename");
+    return 2;
+  }
+  if (batch_mode ? optind == argc && !lists : optind != argc - 1) {
     err("expected one filename argument");
     return 2;
   }
+  if (configured && (resume || expand || render)) {
+    err("-m cannot be used with -k, -x or -r, which replay a recorded pipeline");
+    return 2;
+  }
+  if (expected && (batch_mode || sampling.period || trace == TRACE_BINARY)) {
+    err("-v verifies the text trace of a single run");
+    return 2;
+  }
+
+  if (limit && !sweep) {
+    err("-l limits the runs of a -w sweep");
+    return 2;
+  }
+
+  if (sweep) {
+    if (optind != argc - 1 || lists || outdir || resume || expand || render || sampling.period
+        || expected || save.count || save.interval || trace == TRACE_DELTA || trace == TRACE_BINARY) {
+      err("-w runs one program untraced and writes only sweep.csv");
+      return 2;
+    }
+    /* each line of the sweep applies to the -m configuration */
+    struct config *configs = malloc(sweeps * sizeof(*configs));
+    if (!configs) {
+      err("could not allocate configurations");
+      return 1;
+    }
+    for (size_t i = 0; i < sweeps; ++i) {
+      configs[i] = config;
+      if (config_parse(&configs[i], specs[i])) {
+        err("invalid pipeline configuration '%s'", specs[i]);
+        return 2;
+      }
+    }
+    if (!jobs)
+      jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char image[4096];
+    snprintf(image, sizeof(image), "%s.img", argv[optind]);
+    size_t failed = program_sweep(argv[optind], cache ? image : NULL, configs, specs, sweeps,
+                                  limit ? limit : SWEEP_CYCLES, jobs > 0 ? jobs : 1, "sweep.csv");
+    if (failed) {
+      err("%zu of %zu configurations failed", failed, sweeps);
+      return 1;
+    }
+    return 0;
+  }
+
+  if (expand) {
+    program_expand(argv[optind], "simulation.txt", expected);
+    return 0;
+  }
+
+  if (render) {
+    program_render(argv[optind], "simulation.txt", expected);
+    return 0;
+  }
+
+  const char *filename = "simulation.txt";
+  if (trace == TRACE_DELTA)
+    filename = "simulation.delta";
+  else if (trace == TRACE_BINARY)
+    filename = "simulation.bin";
+  if (sampling.period)
+    filename = "sampling.txt";
+
+  /* by default, single runs format full traces on a spare core and batch
+     runs leave the cores to their jobs */
+  if (formatters < 0)
+    formatters = !batch_mode && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+  if (batch_mode) {
+    inputs = realloc(inputs, (count + argc - optind + 1) * sizeof(*inputs));
+    if (!inputs) {
+      err("could not allocate input list");
+      return 1;
+    }
+    for (int i = optind; i < argc; ++i)
+      inputs[count++] = argv[i];
+    if (!jobs)
+      jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    struct batch batch = {
+      .inputs = inputs,
+      .count = count,
+      .outdir = outdir,
+      .output = filename,
+      .cache = cache,
+      .trace = trace,
+      .formatters = formatters,
+      .resume = resume,
+      .config = &config,
+      .save = &save,
+      .sampling = sampling.period ? &sampling : NULL,
+      .workers = jobs > 0 ? jobs : 1,
+    };
+    size_t failed = program_batch(&batch);
+    if (failed) {
+      err("%zu of %zu inputs failed", failed, count);
+      return 1;
+    }
+    return 0;
+  }
 
-  program_load(argv[1]);
-  program_simulate("simulation.txt");
+  char image[4096];
+  snprintf(image, sizeof(image), "%s.img", argv[optind]);
+  char base[4096];
+  checkpoint_base(base, sizeof(base), argv[optind]);
+  struct machine machine;
+  if (resume)
+    checkpoint_load(&machine, argv[optind]);
+  else
+    program_load(&machine, argv[optind], cache ? image : NULL, &config);
+  if (sampling.period)
+    program_sample(&machine, filename, &sampling);
+  else
+    program_simulate(&machine, filename, expected, "statistics.txt", trace, formatters, &save, base);
   return 0;
 }